@@ -0,0 +1,449 @@
+// Load generator and latency benchmark for the chat server.
+//
+// Logs in many simulated clients from a users.txt-style credential file, has them send a
+// configurable mix of /msg, /broadcast and /group_msg traffic at a fixed total rate, and
+// reports throughput and end-to-end delivery latency. Every message carries its send time,
+// so the receiving client measures latency directly; sender and receivers run on the same
+// host against a server on loopback, so they share one monotonic clock.
+
+#include <iostream>
+#include <fstream>
+#include <string>
+#include <string_view>
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <atomic>
+#include <chrono>
+#include <random>
+#include <algorithm>
+#include <cstring>
+#include <cstdlib>
+#include <cerrno>
+#include <unistd.h>
+#include <fcntl.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+
+#define BUFFER_SIZE 65536
+#define MAX_EVENTS 256
+
+// Benchmark settings, filled in from the command line.
+struct Options {
+    std::string host = "127.0.0.1";
+    int port = 12345;
+    std::string users_file = "users.txt";
+    int clients = 0;            // 0 = one client per credential in the file.
+    int threads = 1;
+    double duration = 10.0;     // Seconds of measured traffic.
+    double rate = 1000.0;       // Messages per second across all clients.
+    int groups = 10;
+    size_t size = 64;           // Bytes of payload per message.
+    int mix_msg = 70, mix_broadcast = 5, mix_group = 25;
+};
+
+struct Credential {
+    std::string username;
+    std::string password;
+};
+
+enum class ClientState { Connecting, LoggingIn, Ready, Failed };
+
+// One simulated user.
+struct Client {
+    int fd = -1;
+    int index;
+    ClientState state = ClientState::Connecting;
+    std::string inbuf;
+    std::string outbuf;
+};
+
+// Counters and latency samples collected by one worker thread.
+struct WorkerStats {
+    uint64_t sent_msg = 0, sent_broadcast = 0, sent_group = 0;
+    uint64_t delivered = 0;
+    uint64_t errors = 0;
+    std::vector<uint32_t> latencies_us;
+};
+
+Options options;
+std::vector<Credential> credentials;
+std::atomic<int> logged_in{0};
+std::atomic<int> login_failures{0};
+std::atomic<bool> measuring{false};
+std::atomic<bool> sending{false};
+std::atomic<bool> stopping{false};
+
+uint64_t now_ns() {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+               std::chrono::steady_clock::now().time_since_epoch())
+        .count();
+}
+
+// Reads "username:password" lines, the same format as the server's users.txt.
+bool load_credentials(const std::string &filename) {
+    std::ifstream file(filename);
+    if (!file.is_open()) {
+        std::cerr << "Error: Unable to open file \"" << filename << "\"." << std::endl;
+        return false;
+    }
+    std::string line;
+    while (std::getline(file, line)) {
+        size_t pos = line.find(':');
+        if (pos != std::string::npos)
+            credentials.push_back({line.substr(0, pos), line.substr(pos + 1)});
+    }
+    return true;
+}
+
+// Writes a credential file with 'count' generated users for use by both server and benchmark.
+bool make_users(int count, const std::string &filename) {
+    std::ofstream file(filename);
+    if (!file.is_open()) {
+        std::cerr << "Error: Unable to write file \"" << filename << "\"." << std::endl;
+        return false;
+    }
+    for (int i = 0; i < count; i++)
+        file << "bench" << i << ":pw" << i << "\n";
+    return true;
+}
+
+// Queues bytes for a client and writes as much as the socket accepts.
+void send_to_server(Client &client, const std::string &data) {
+    client.outbuf += data;
+    while (!client.outbuf.empty()) {
+        ssize_t n = send(client.fd, client.outbuf.data(), client.outbuf.size(), MSG_NOSIGNAL);
+        if (n > 0) {
+            client.outbuf.erase(0, n);
+            continue;
+        }
+        if (n < 0 && errno == EINTR)
+            continue;
+        break;  // EAGAIN: the rest goes out on EPOLLOUT.
+    }
+}
+
+// Handles one line from the server: login progress, or a benchmark message whose
+// embedded send time gives the delivery latency.
+void handle_line(Client &client, std::string_view line, WorkerStats &stats) {
+    if (client.state == ClientState::LoggingIn) {
+        if (line.find("Welcome") != std::string_view::npos) {
+            client.state = ClientState::Ready;
+            logged_in++;
+            // Every client joins one group. Whichever member's /create_group arrives first
+            // creates it; the other requests fail harmlessly.
+            std::string group = "bgroup" + std::to_string(client.index % options.groups);
+            send_to_server(client, "/create_group " + group + "\n/join_group " + group + "\n");
+        } else if (line.find("Error") != std::string_view::npos) {
+            client.state = ClientState::Failed;
+            login_failures++;
+        }
+        return;
+    }
+
+    size_t tag = line.find("BENCH ");
+    if (tag == std::string_view::npos) {
+        // Setup replies about groups that already exist or were already joined are expected.
+        if (line.rfind("Error", 0) == 0 && line.find("lready") == std::string_view::npos)
+            stats.errors++;
+        return;
+    }
+    if (!measuring)
+        return;
+    uint64_t sent_at = strtoull(std::string(line.substr(tag + 6, 20)).c_str(), nullptr, 10);
+    uint64_t now = now_ns();
+    stats.delivered++;
+    stats.latencies_us.push_back(now > sent_at ? (uint32_t)std::min<uint64_t>((now - sent_at) / 1000, UINT32_MAX) : 0);
+}
+
+// Reads everything available from a client's socket and handles each complete line.
+// Returns false if the server closed the connection.
+bool read_from_server(Client &client, WorkerStats &stats) {
+    char buffer[BUFFER_SIZE];
+    while (true) {
+        ssize_t n = recv(client.fd, buffer, sizeof(buffer), 0);
+        if (n == 0)
+            return false;
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            return errno == EAGAIN || errno == EWOULDBLOCK;
+        }
+        client.inbuf.append(buffer, n);
+        size_t start = 0, newline;
+        while ((newline = client.inbuf.find('\n', start)) != std::string::npos) {
+            handle_line(client, std::string_view(client.inbuf).substr(start, newline - start), stats);
+            start = newline + 1;
+        }
+        client.inbuf.erase(0, start);
+    }
+}
+
+// Builds one benchmark command of a randomly chosen type.
+std::string make_command(Client &client, std::mt19937_64 &rng, WorkerStats &stats) {
+    std::string body = "BENCH " + std::to_string(now_ns()) + " ";
+    if (body.size() < options.size)
+        body.append(options.size - body.size(), 'x');
+
+    int pick = rng() % (options.mix_msg + options.mix_broadcast + options.mix_group);
+    if (pick < options.mix_msg) {
+        int target = rng() % options.clients;
+        if (target == client.index)
+            target = (target + 1) % options.clients;
+        stats.sent_msg++;
+        return "/msg " + credentials[target].username + " " + body + "\n";
+    }
+    if (pick < options.mix_msg + options.mix_broadcast) {
+        stats.sent_broadcast++;
+        return "/broadcast " + body + "\n";
+    }
+    stats.sent_group++;
+    return "/group_msg bgroup" + std::to_string(client.index % options.groups) + " " + body + "\n";
+}
+
+// Runs the clients assigned to one worker: connects and logs them in, then sends this
+// worker's share of the message rate and records deliveries until told to stop.
+void run_worker(int worker, WorkerStats &stats) {
+    int epoll_fd = epoll_create1(0);
+    std::vector<Client> clients;
+    for (int i = worker; i < options.clients; i += options.threads) {
+        Client client;
+        client.index = i;
+        clients.push_back(client);
+    }
+
+    sockaddr_in server_address{};
+    server_address.sin_family = AF_INET;
+    server_address.sin_port = htons(options.port);
+    server_address.sin_addr.s_addr = inet_addr(options.host.c_str());
+
+    for (size_t i = 0; i < clients.size(); i++) {
+        Client &client = clients[i];
+        client.fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+        if (client.fd < 0) {
+            client.state = ClientState::Failed;
+            login_failures++;
+            continue;
+        }
+        int one = 1;
+        setsockopt(client.fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+        if (connect(client.fd, (sockaddr *)&server_address, sizeof(server_address)) < 0 && errno != EINPROGRESS) {
+            close(client.fd);
+            client.state = ClientState::Failed;
+            login_failures++;
+            continue;
+        }
+        epoll_event ev{};
+        ev.events = EPOLLIN | EPOLLOUT | EPOLLET;
+        ev.data.u64 = i;
+        epoll_ctl(epoll_fd, EPOLL_CTL_ADD, client.fd, &ev);
+    }
+
+    std::mt19937_64 rng(worker * 7919 + 1);
+    double per_worker_rate = options.rate / options.threads;
+    uint64_t send_start = 0;
+    uint64_t sent = 0;
+    epoll_event events[MAX_EVENTS];
+
+    while (!stopping) {
+        int ready = epoll_wait(epoll_fd, events, MAX_EVENTS, 1);
+        for (int e = 0; e < ready; e++) {
+            Client &client = clients[events[e].data.u64];
+            if (client.state == ClientState::Failed)
+                continue;
+            if (events[e].events & (EPOLLERR | EPOLLHUP)) {
+                if (client.state != ClientState::Ready)
+                    login_failures++;
+                client.state = ClientState::Failed;
+                close(client.fd);
+                continue;
+            }
+            if (client.state == ClientState::Connecting && (events[e].events & EPOLLOUT)) {
+                client.state = ClientState::LoggingIn;
+                const Credential &cred = credentials[client.index];
+                send_to_server(client, cred.username + "\n" + cred.password + "\n");
+            }
+            if (events[e].events & EPOLLOUT)
+                send_to_server(client, "");
+            if ((events[e].events & EPOLLIN) && !read_from_server(client, stats)) {
+                if (client.state != ClientState::Ready)
+                    login_failures++;
+                client.state = ClientState::Failed;
+                close(client.fd);
+            }
+        }
+
+        // Open-loop sending: catch up to the number of messages owed at this point in time.
+        if (sending && !clients.empty()) {
+            uint64_t now = now_ns();
+            if (send_start == 0)
+                send_start = now;
+            uint64_t owed = (uint64_t)((now - send_start) / 1e9 * per_worker_rate);
+            while (sent < owed) {
+                Client &client = clients[rng() % clients.size()];
+                sent++;
+                if (client.state == ClientState::Ready)
+                    send_to_server(client, make_command(client, rng, stats));
+            }
+        }
+    }
+
+    for (Client &client : clients)
+        if (client.state != ClientState::Failed)
+            close(client.fd);
+    close(epoll_fd);
+}
+
+// Parses "msg=70,broadcast=5,group=25".
+bool parse_mix(const std::string &text) {
+    options.mix_msg = options.mix_broadcast = options.mix_group = 0;
+    size_t start = 0;
+    while (start < text.size()) {
+        size_t comma = text.find(',', start);
+        std::string item = text.substr(start, comma == std::string::npos ? std::string::npos : comma - start);
+        size_t eq = item.find('=');
+        if (eq == std::string::npos)
+            return false;
+        std::string name = item.substr(0, eq);
+        int weight = atoi(item.c_str() + eq + 1);
+        if (name == "msg")
+            options.mix_msg = weight;
+        else if (name == "broadcast")
+            options.mix_broadcast = weight;
+        else if (name == "group")
+            options.mix_group = weight;
+        else
+            return false;
+        if (comma == std::string::npos)
+            break;
+        start = comma + 1;
+    }
+    return options.mix_msg + options.mix_broadcast + options.mix_group > 0;
+}
+
+void usage(const char *program) {
+    std::cerr << "Usage: " << program << " [options]\n"
+              << "  --users FILE        credentials, one username:password per line (default users.txt)\n"
+              << "  --clients N         simulated clients (default: one per credential)\n"
+              << "  --threads N         worker threads (default 1)\n"
+              << "  --duration SECONDS  measured traffic time (default 10)\n"
+              << "  --rate N            messages per second across all clients (default 1000)\n"
+              << "  --mix SPEC          traffic mix, e.g. msg=70,broadcast=5,group=25\n"
+              << "  --groups N          groups the clients are spread over (default 10)\n"
+              << "  --size BYTES        payload size per message (default 64)\n"
+              << "  --host ADDR --port N  server address (default 127.0.0.1:12345)\n"
+              << "  --make-users N FILE write a credential file with N users and exit\n";
+}
+
+uint32_t percentile(const std::vector<uint32_t> &sorted, double p) {
+    if (sorted.empty())
+        return 0;
+    size_t index = std::min(sorted.size() - 1, (size_t)(p * sorted.size()));
+    return sorted[index];
+}
+
+int main(int argc, char *argv[]) {
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+        bool has_value = i + 1 < argc;
+        if (arg == "--make-users" && i + 2 < argc)
+            return make_users(atoi(argv[i + 1]), argv[i + 2]) ? 0 : 1;
+        else if (arg == "--users" && has_value)
+            options.users_file = argv[++i];
+        else if (arg == "--clients" && has_value)
+            options.clients = atoi(argv[++i]);
+        else if (arg == "--threads" && has_value)
+            options.threads = std::max(1, atoi(argv[++i]));
+        else if (arg == "--duration" && has_value)
+            options.duration = atof(argv[++i]);
+        else if (arg == "--rate" && has_value)
+            options.rate = atof(argv[++i]);
+        else if (arg == "--groups" && has_value)
+            options.groups = std::max(1, atoi(argv[++i]));
+        else if (arg == "--size" && has_value)
+            options.size = strtoul(argv[++i], nullptr, 10);
+        else if (arg == "--host" && has_value)
+            options.host = argv[++i];
+        else if (arg == "--port" && has_value)
+            options.port = atoi(argv[++i]);
+        else if (arg == "--mix" && has_value) {
+            if (!parse_mix(argv[++i])) {
+                std::cerr << "Error: Invalid traffic mix." << std::endl;
+                return 1;
+            }
+        } else {
+            usage(argv[0]);
+            return 1;
+        }
+    }
+
+    if (!load_credentials(options.users_file))
+        return 1;
+    if (options.clients == 0 || options.clients > (int)credentials.size())
+        options.clients = credentials.size();
+    if (options.clients < 2) {
+        std::cerr << "Error: At least two credentials are needed." << std::endl;
+        return 1;
+    }
+    options.threads = std::min(options.threads, options.clients);
+
+    rlimit fd_limit{};
+    if (getrlimit(RLIMIT_NOFILE, &fd_limit) == 0) {
+        fd_limit.rlim_cur = fd_limit.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &fd_limit);
+    }
+
+    std::vector<WorkerStats> stats(options.threads);
+    std::vector<std::thread> workers;
+    for (int i = 0; i < options.threads; i++)
+        workers.emplace_back(run_worker, i, std::ref(stats[i]));
+
+    // Wait for logins to settle (every client logged in or failed, or 30 s).
+    auto login_start = std::chrono::steady_clock::now();
+    while (logged_in + login_failures < options.clients &&
+           std::chrono::steady_clock::now() - login_start < std::chrono::seconds(30))
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    double login_seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - login_start).count();
+    std::cout << "Logged in " << logged_in << "/" << options.clients << " clients in " << login_seconds
+              << " s (" << login_failures << " failed)." << std::endl;
+
+    // Let the group joins land, then send and measure for the configured duration, and
+    // give in-flight messages a moment to arrive.
+    std::this_thread::sleep_for(std::chrono::milliseconds(500));
+    measuring = true;
+    sending = true;
+    auto measure_start = std::chrono::steady_clock::now();
+    std::this_thread::sleep_for(std::chrono::duration<double>(options.duration));
+    sending = false;
+    double send_seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - measure_start).count();
+    std::this_thread::sleep_for(std::chrono::seconds(1));
+    stopping = true;
+    for (auto &worker : workers)
+        worker.join();
+
+    WorkerStats total;
+    for (WorkerStats &s : stats) {
+        total.sent_msg += s.sent_msg;
+        total.sent_broadcast += s.sent_broadcast;
+        total.sent_group += s.sent_group;
+        total.delivered += s.delivered;
+        total.errors += s.errors;
+        total.latencies_us.insert(total.latencies_us.end(), s.latencies_us.begin(), s.latencies_us.end());
+    }
+    std::sort(total.latencies_us.begin(), total.latencies_us.end());
+    uint64_t sent = total.sent_msg + total.sent_broadcast + total.sent_group;
+
+    std::cout << "Sent:      " << sent << " messages in " << send_seconds << " s (" << sent / send_seconds
+              << " msg/s; msg " << total.sent_msg << ", broadcast " << total.sent_broadcast
+              << ", group " << total.sent_group << ")" << std::endl;
+    std::cout << "Delivered: " << total.delivered << " messages (" << total.delivered / send_seconds
+              << " msg/s), " << total.errors << " error replies" << std::endl;
+    std::cout << "Latency:   p50 " << percentile(total.latencies_us, 0.50) << " us, p99 "
+              << percentile(total.latencies_us, 0.99) << " us, p999 " << percentile(total.latencies_us, 0.999)
+              << " us, max " << (total.latencies_us.empty() ? 0 : total.latencies_us.back()) << " us" << std::endl;
+    return 0;
+}
@@ -1,6 +1,7 @@
 // Client-side implementation in C++ for a chat server with private messages and group messaging
 
 #include <iostream>
+#include <algorithm>
 #include <string>
 #include <thread>
 #include <mutex>
@@ -10,15 +11,258 @@
 #include <sstream>
 #include <cstring>
 #include <cstdlib>
+#include <cerrno>
+#include <chrono>
+#include <fstream>
+#include <fcntl.h>
+#include <poll.h>
 #include <unistd.h>
 #include <arpa/inet.h>
 
 #define BUFFER_SIZE 1024
+#define MAX_BATCH (64 * 1024) // Scripted mode: input is read only while less is queued.
+#define PASSWORD_MARK "<password>" // Stands for the password in a recorded trace.
 
 std::mutex cout_mutex;
+std::mutex send_mutex;
+
+// Binary mode ("--binary"): after "/frame binary", traffic in both directions is made of
+// binary frames: a type byte, the varint length of the body, and the body. Users and
+// groups are named by ids the server assigns and announces in Name frames.
+enum FrameType : uint8_t { FrameText, FrameName, FrameDirect, FrameBroadcast, FrameGroup };
+
+bool binary_mode = false;
+std::string pending_input; // Binary mode: received bytes not yet parsed into frames.
+std::unordered_map<uint64_t, std::string> names; // Id -> name, from Name frames.
+std::unordered_map<std::string, uint64_t> name_ids;
+std::mutex names_mutex;
+
+// Scripted mode ("--script" or "--replay"): a single thread drives a non-blocking socket.
+// Commands are appended to 'outgoing' and written together, so a batch of commands read
+// at once goes out in one send.
+bool batching = false;
+std::string outgoing;
+std::chrono::steady_clock::time_point start_time = std::chrono::steady_clock::now();
+std::ofstream trace_file; // "--record": every command sent, with its time.
+int commands_recorded = 0;
+std::string replay_password; // "--password": sent for PASSWORD_MARK when replaying.
+
+// Milliseconds since the client started.
+double elapsed_ms() {
+    return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start_time).count();
+}
+
+// Writes bytes to the server, or queues them for the next batch in scripted mode.
+void transmit(int server_socket, const std::string &bytes) {
+    if (batching) {
+        outgoing += bytes;
+        return;
+    }
+    std::lock_guard<std::mutex> lock(send_mutex);
+    send(server_socket, bytes.data(), bytes.size(), 0);
+}
+
+// Appends a command to the trace as "<milliseconds> <command>", the format "--replay" reads.
+// The second line sent is always the password, so it is written as PASSWORD_MARK.
+void record_command(const std::string &line) {
+    if (!trace_file.is_open())
+        return;
+    char stamp[32];
+    snprintf(stamp, sizeof(stamp), "%.3f ", elapsed_ms());
+    trace_file << stamp << (++commands_recorded == 2 ? PASSWORD_MARK : line) << '\n';
+    if (!batching)
+        trace_file.flush(); // Keep the trace if an interactive session is interrupted.
+}
+
+void put_varint(std::string &out, uint64_t value) {
+    while (value >= 0x80) {
+        out += char(value | 0x80);
+        value >>= 7;
+    }
+    out += char(value);
+}
+
+// Reads a varint at 'pos' in 'in', advancing 'pos'. Returns false if it is incomplete.
+bool take_varint(const std::string &in, size_t &pos, uint64_t &value) {
+    value = 0;
+    for (size_t i = 0; pos + i < in.size() && i < 10; i++) {
+        value |= uint64_t((unsigned char)in[pos + i] & 0x7f) << (7 * i);
+        if (!(in[pos + i] & 0x80)) {
+            pos += i + 1;
+            return true;
+        }
+    }
+    return false;
+}
+
+void send_frame(int server_socket, FrameType type, const std::string &body) {
+    std::string frame(1, char(type));
+    put_varint(frame, body.size());
+    frame += body;
+    transmit(server_socket, frame);
+}
+
+// Sends one command to the server. Commands are newline-terminated so the server can
+// tell them apart even when TCP merges or splits writes; in binary mode they go in
+// Text frames.
+void send_line(int server_socket, const std::string &line) {
+    if (binary_mode) {
+        send_frame(server_socket, FrameText, line);
+        return;
+    }
+    transmit(server_socket, line + "\n");
+}
+
+// Returns the id the server gave a name, if it has announced one.
+bool find_name_id(const std::string &name, uint64_t &id) {
+    std::lock_guard<std::mutex> lock(names_mutex);
+    auto it = name_ids.find(name);
+    if (it == name_ids.end())
+        return false;
+    id = it->second;
+    return true;
+}
+
+// Sends a command typed by the user. In binary mode, /broadcast, and /msg and
+// /group_msg to a user or group whose id is known, go as compact frames.
+void send_command(int server_socket, const std::string &line) {
+    record_command(line);
+    if (binary_mode) {
+        uint64_t id;
+        size_t space1 = line.find(' ');
+        size_t space2 = space1 == std::string::npos ? space1 : line.find(' ', space1 + 1);
+        std::string word = line.substr(0, space1);
+        if (word == "/broadcast" && space1 != std::string::npos) {
+            send_frame(server_socket, FrameBroadcast, line.substr(space1 + 1));
+            return;
+        }
+        if ((word == "/msg" || word == "/group_msg") && space2 != std::string::npos &&
+            find_name_id(line.substr(space1 + 1, space2 - space1 - 1), id)) {
+            std::string body;
+            put_varint(body, id);
+            body += line.substr(space2 + 1);
+            send_frame(server_socket, word == "/msg" ? FrameDirect : FrameGroup, body);
+            return;
+        }
+    }
+    send_line(server_socket, line);
+}
+
+// Answers the server's heartbeat pings ("/ping" lines) with "/pong" and removes them
+// from the text shown to the user. 'line_start' tells whether 'text' begins a line.
+void answer_pings(int server_socket, std::string &text, bool line_start = true) {
+    size_t pos = 0;
+    while ((pos = text.find("/ping\n", pos)) != std::string::npos) {
+        if (pos == 0 ? line_start : text[pos - 1] == '\n') {
+            text.erase(pos, 6);
+            send_line(server_socket, "/pong");
+        } else {
+            pos++;
+        }
+    }
+}
+
+// Removes and returns the partial line at the end of 'text' if it could be the start of
+// a ping split across reads, so it is checked again once the rest arrives.
+std::string hold_partial_ping(std::string &text, bool line_start) {
+    size_t start = text.rfind('\n');
+    start = start == std::string::npos ? 0 : start + 1;
+    size_t length = text.size() - start;
+    if (length == 0 || length > 5 || (start == 0 && !line_start) ||
+        text.compare(start, length, "/ping", length) != 0)
+        return "";
+    std::string partial = text.substr(start);
+    text.erase(start);
+    return partial;
+}
+
+// Binary mode: takes the next complete frame from 'pending_input', if there is one.
+bool take_frame(uint8_t &type, std::string &body) {
+    size_t pos = 1;
+    uint64_t length;
+    if (pending_input.size() <= 1 || !take_varint(pending_input, pos, length) ||
+        pending_input.size() - pos < length)
+        return false;
+    type = pending_input[0];
+    body = pending_input.substr(pos, length);
+    pending_input.erase(0, pos + length);
+    return true;
+}
+
+// Binary mode: takes the next complete frame from 'pending_input', receiving more as
+// needed. Returns false if the server disconnected.
+bool read_frame(int server_socket, uint8_t &type, std::string &body) {
+    while (true) {
+        if (take_frame(type, body))
+            return true;
+        char buffer[BUFFER_SIZE];
+        int bytes_received = recv(server_socket, buffer, BUFFER_SIZE, 0);
+        if (bytes_received <= 0)
+            return false;
+        pending_input.append(buffer, bytes_received);
+    }
+}
+
+// Binary mode: returns the body of the next Text frame, handling Name frames on the
+// way. Returns an empty string if the server disconnected.
+std::string read_text_frame(int server_socket) {
+    uint8_t type;
+    std::string body;
+    while (read_frame(server_socket, type, body)) {
+        if (type == FrameText)
+            return body;
+    }
+    return "";
+}
+
+// Renders a binary frame as the text protocol would show it, recording announced names.
+std::string render_frame(uint8_t type, const std::string &body) {
+    size_t pos = 0;
+    uint64_t id = 0;
+    if (type == FrameText || !take_varint(body, pos, id))
+        return body;
+    std::string message = body.substr(pos);
+    std::lock_guard<std::mutex> lock(names_mutex);
+    switch (type) {
+    case FrameName:
+        names[id] = message;
+        name_ids[message] = id;
+        return "";
+    case FrameDirect:
+        return "[" + names[id] + "]: " + message + "\n";
+    case FrameBroadcast:
+        return "[" + names[id] + "] (Broadcast): " + message + "\n";
+    case FrameGroup:
+        return "[Group " + names[id] + "]: " + message + "\n";
+    default:
+        return "";
+    }
+}
+
+void handle_binary_messages(int server_socket) {
+    uint8_t type;
+    std::string body;
+    while (read_frame(server_socket, type, body)) {
+        std::string text = render_frame(type, body);
+        if (type == FrameText)
+            answer_pings(server_socket, text);
+        if (text.empty())
+            continue;
+        if (text.back() == '\n')
+            text.pop_back();
+        std::lock_guard<std::mutex> lock(cout_mutex);
+        std::cout << text << std::endl;
+    }
+    std::lock_guard<std::mutex> lock(cout_mutex);
+    std::cout << "Disconnected from server." << std::endl;
+    close(server_socket);
+    exit(0);
+}
 
 void handle_server_messages(int server_socket) {
     char buffer[BUFFER_SIZE];
+    std::string partial;    // The start of a line held back by hold_partial_ping().
+    bool line_start = true; // Whether the next text received begins a line.
     while (true) {
         memset(buffer, 0, BUFFER_SIZE);
         int bytes_received = recv(server_socket, buffer, BUFFER_SIZE, 0);
@@ -28,12 +272,245 @@ void handle_server_messages(int server_socket) {
             close(server_socket);
             exit(0);
         }
+        std::string text = partial + std::string(buffer, bytes_received);
+        answer_pings(server_socket, text, line_start);
+        partial = hold_partial_ping(text, line_start);
+        if (text.empty())
+            continue;
+        line_start = text.back() == '\n';
         std::lock_guard<std::mutex> lock(cout_mutex);
-        std::cout << buffer << std::endl;
+        std::cout << text << std::endl;
+    }
+}
+
+// Scripted mode: prints received text line by line, each line stamped with the
+// milliseconds since the client started, and answers pings. A partial line stays in
+// 'received' until the rest arrives, so the output does not depend on how the stream
+// was split; with 'flush' it is printed as it is.
+void show_received(int server_socket, std::string &received, bool flush = false) {
+    if (binary_mode) {
+        uint8_t type;
+        std::string body;
+        while (take_frame(type, body)) {
+            std::string text = render_frame(type, body);
+            if (type == FrameText)
+                answer_pings(server_socket, text);
+            received += text;
+        }
+    } else {
+        answer_pings(server_socket, received);
     }
+    size_t start = 0;
+    while (start < received.size()) {
+        size_t end = received.find('\n', start);
+        if (end == std::string::npos) {
+            if (!flush)
+                break;
+            end = received.size();
+        }
+        char stamp[32];
+        snprintf(stamp, sizeof(stamp), "[%10.3f] ", elapsed_ms());
+        std::cout << stamp << std::string_view(received).substr(start, end - start) << '\n';
+        start = end + 1;
+    }
+    received.erase(0, std::min(start, received.size()));
+    std::cout.flush();
 }
 
-int main() {
+// Scripted mode: sends the commands read from 'input_fd' (a file or a pipe) without
+// waiting for replies, and prints everything received with a timestamp. The login lines
+// come first in the input, like anything else. With 'timed', each input line is
+// "<milliseconds> <command>" as written by "--record", and commands are sent with the
+// recorded gaps between them divided by 'speed'; a PASSWORD_MARK line is replaced with
+// the "--password" option or, failing that, a password typed at a prompt. Returns once
+// the input is used up and nothing has been sent or received for 'linger_ms', or when
+// the server disconnects.
+int run_script(int server_socket, int input_fd, bool timed, double speed, int linger_ms) {
+    std::string script, received;
+    char buffer[BUFFER_SIZE * 16];
+    if (binary_mode) {
+        // The login prompt comes before the switch to frames, as in interactive mode.
+        ssize_t n = recv(server_socket, buffer, sizeof(buffer), 0);
+        received.assign(buffer, std::max<ssize_t>(n, 0));
+        show_received(server_socket, received, true);
+        outgoing += "/frame binary\n";
+    }
+    batching = true;
+    fcntl(server_socket, F_SETFL, fcntl(server_socket, F_GETFL) | O_NONBLOCK);
+    fcntl(input_fd, F_SETFL, fcntl(input_fd, F_GETFL) | O_NONBLOCK);
+
+    bool input_done = false;
+    double first_at = -1, replay_start = 0; // Trace time of the first command, and when it was sent.
+    double quiet_since = elapsed_ms();
+    while (true) {
+        // Queue every command that is due, reading more input as needed.
+        double wait_ms = -1;
+        while (outgoing.size() < MAX_BATCH) {
+            size_t end = script.find('\n');
+            if (end == std::string::npos) {
+                if (input_done) {
+                    if (script.empty())
+                        break;
+                    script += '\n'; // A last line without a newline.
+                    continue;
+                }
+                ssize_t n = read(input_fd, buffer, sizeof(buffer));
+                if (n > 0)
+                    script.append(buffer, n);
+                else if (n == 0 || (errno != EAGAIN && errno != EWOULDBLOCK))
+                    input_done = true;
+                else
+                    break;
+                continue;
+            }
+            std::string_view line(script.data(), end);
+            if (!line.empty() && line.back() == '\r')
+                line.remove_suffix(1);
+            if (timed && !line.empty()) {
+                char *rest;
+                double at = strtod(script.c_str(), &rest);
+                if (rest == script.c_str() || rest > script.c_str() + end) {
+                    std::cerr << "Skipping malformed trace line: " << line << std::endl;
+                    line = {};
+                } else {
+                    if (first_at < 0) {
+                        first_at = at;
+                        replay_start = elapsed_ms();
+                    }
+                    double due = replay_start + (at - first_at) / speed;
+                    if (due > elapsed_ms()) {
+                        wait_ms = due - elapsed_ms();
+                        break;
+                    }
+                    line.remove_prefix(std::min(line.size(), size_t(rest - script.c_str())));
+                    if (!line.empty() && line.front() == ' ')
+                        line.remove_prefix(1);
+                }
+            }
+            if (timed && line == PASSWORD_MARK && replay_password.empty()) {
+                if (input_fd == STDIN_FILENO) {
+                    std::cerr << "The trace has no password; give it with --password." << std::endl;
+                    close(server_socket);
+                    return 1;
+                }
+                std::cout << "Password: " << std::flush;
+                std::getline(std::cin, replay_password);
+            }
+            if (timed && line == PASSWORD_MARK)
+                send_command(server_socket, replay_password);
+            else if (!line.empty())
+                send_command(server_socket, std::string(line));
+            script.erase(0, end + 1);
+        }
+
+        // Write as much of the batch as the socket takes.
+        bool disconnected = false;
+        if (!outgoing.empty()) {
+            ssize_t n = send(server_socket, outgoing.data(), outgoing.size(), MSG_NOSIGNAL);
+            if (n > 0) {
+                outgoing.erase(0, n);
+                quiet_since = elapsed_ms();
+            } else if (n < 0 && errno != EAGAIN && errno != EWOULDBLOCK) {
+                disconnected = true;
+            }
+        }
+
+        int timeout = -1;
+        if (wait_ms >= 0)
+            timeout = int(wait_ms) + 1;
+        if (input_done && script.empty() && outgoing.empty()) {
+            double left = linger_ms - (elapsed_ms() - quiet_since);
+            if (left <= 0)
+                break;
+            timeout = int(left) + 1;
+        }
+        pollfd fds[2] = {{server_socket, short(POLLIN | (outgoing.empty() ? 0 : POLLOUT)), 0},
+                         {input_fd, POLLIN, 0}};
+        bool want_input = !input_done && wait_ms < 0 && outgoing.size() < MAX_BATCH;
+        if (!disconnected && poll(fds, want_input ? 2 : 1, timeout) < 0 && errno != EINTR)
+            disconnected = true;
+
+        // Receive everything that has arrived.
+        if (!disconnected && (fds[0].revents & (POLLIN | POLLHUP | POLLERR))) {
+            while (true) {
+                ssize_t n = recv(server_socket, buffer, sizeof(buffer), 0);
+                if (n > 0) {
+                    (binary_mode ? pending_input : received).append(buffer, n);
+                    quiet_since = elapsed_ms();
+                } else {
+                    disconnected = n == 0 || (errno != EAGAIN && errno != EWOULDBLOCK);
+                    break;
+                }
+            }
+            show_received(server_socket, received);
+        }
+        if (disconnected) {
+            show_received(server_socket, received, true);
+            received = "Disconnected from server.";
+            show_received(server_socket, received, true);
+            close(server_socket);
+            return 0;
+        }
+    }
+    show_received(server_socket, received, true);
+    close(server_socket);
+    return 0;
+}
+
+int main(int argc, char *argv[]) {
+    // The server port may be given as an argument, e.g. for a cluster node on another
+    // port, and "--binary" selects the binary protocol. "--script FILE" and
+    // "--replay FILE" ("-" is standard input) select scripted mode.
+    int port = 12345;
+    std::string script_path, trace_path;
+    bool timed = false;
+    double speed = 1;
+    int linger_ms = 1000;
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+        bool has_value = i + 1 < argc;
+        if (arg == "--binary") {
+            binary_mode = true;
+        } else if ((arg == "--script" || arg == "--replay") && has_value) {
+            script_path = argv[++i];
+            timed = arg == "--replay";
+        } else if (arg == "--record" && has_value) {
+            trace_path = argv[++i];
+        } else if (arg == "--password" && has_value) {
+            replay_password = argv[++i];
+        } else if (arg == "--speed" && has_value) {
+            speed = atof(argv[++i]);
+        } else if (arg == "--linger" && has_value) {
+            linger_ms = atoi(argv[++i]);
+        } else if (arg[0] != '-') {
+            port = atoi(argv[i]);
+        } else {
+            std::cerr << "Usage: " << argv[0] << " [PORT] [--binary] [--script FILE | --replay FILE [--speed X]"
+                      << " [--password PASS]] [--record FILE] [--linger MS]" << std::endl
+                      << "Traces written with --record replace the password with " PASSWORD_MARK
+                      << "; --replay asks for it unless --password is given." << std::endl;
+            return 1;
+        }
+    }
+    if (speed <= 0) {
+        std::cerr << "--speed must be positive." << std::endl;
+        return 1;
+    }
+    int input_fd = STDIN_FILENO;
+    if (!script_path.empty() && script_path != "-") {
+        input_fd = open(script_path.c_str(), O_RDONLY | O_CLOEXEC);
+        if (input_fd < 0) {
+            std::cerr << "Error opening " << script_path << ": " << strerror(errno) << std::endl;
+            return 1;
+        }
+    }
+    if (!trace_path.empty()) {
+        trace_file.open(trace_path);
+        if (!trace_file) {
+            std::cerr << "Error opening " << trace_path << std::endl;
+            return 1;
+        }
+    }
     int client_socket;
     sockaddr_in server_address{};
 
@@ -44,7 +521,7 @@ int main() {
     }
 
     server_address.sin_family = AF_INET;
-    server_address.sin_port = htons(12345);
+    server_address.sin_port = htons(port);
     server_address.sin_addr.s_addr = inet_addr("127.0.0.1");
 
     if (connect(client_socket, (sockaddr*)&server_address, sizeof(server_address)) < 0) {
@@ -54,6 +531,9 @@ int main() {
 
     std::cout << "Connected to the server." << std::endl;
 
+    if (!script_path.empty())
+        return run_script(client_socket, input_fd, timed, speed, linger_ms);
+
     // Authentication
     std::string username, password;
     char buffer[BUFFER_SIZE];
@@ -63,38 +543,59 @@ int main() {
     // You should have a line like this in the server.cpp code: send_message(client_socket, "Enter username: ");
  
     std::cout << buffer;
+
+    // Switch to binary frames; the server confirms in the first one.
+    if (binary_mode) {
+        send(client_socket, "/frame binary\n", 14, 0);
+        read_text_frame(client_socket);
+    }
+
     std::getline(std::cin, username);
-    send(client_socket, username.c_str(), username.size(), 0);
+    record_command(username);
+    send_line(client_socket, username);
 
-    memset(buffer, 0, BUFFER_SIZE);
-    recv(client_socket, buffer, BUFFER_SIZE, 0); // Receive the message "Enter the password" for the server
-    std::cout << buffer;
+    std::string reply;
+    if (binary_mode) {
+        reply = read_text_frame(client_socket);
+    } else {
+        memset(buffer, 0, BUFFER_SIZE);
+        recv(client_socket, buffer, BUFFER_SIZE, 0); // Receive the message "Enter the password" for the server
+        reply = buffer;
+    }
+    std::cout << reply;
     std::getline(std::cin, password);
-    send(client_socket, password.c_str(), password.size(), 0);
+    record_command(password);
+    send_line(client_socket, password);
 
-    memset(buffer, 0, BUFFER_SIZE);
     // Depending on whether the authentication passes or not, receive the message "Authentication Failed" or "Welcome to the server"
-    recv(client_socket, buffer, BUFFER_SIZE, 0); 
-    std::cout << buffer << std::endl;
+    if (binary_mode) {
+        reply = read_text_frame(client_socket);
+    } else {
+        memset(buffer, 0, BUFFER_SIZE);
+        recv(client_socket, buffer, BUFFER_SIZE, 0);
+        reply = buffer;
+    }
+    std::cout << reply << std::endl;
 
-    if (std::string(buffer).find("Authentication failed") != std::string::npos) {
+    if (reply.find("Authentication failed") != std::string::npos) {
         close(client_socket);
         return 1;
     }
 
     // Start thread for receiving messages from server
-    std::thread receive_thread(handle_server_messages, client_socket);
+    std::thread receive_thread(binary_mode ? handle_binary_messages : handle_server_messages, client_socket);
     // We use detach because we want this thread to run in the background while the main thread continues running
     receive_thread.detach();
 
     // Send messages to the server
     while (true) {
         std::string message;
-        std::getline(std::cin, message);
+        if (!std::getline(std::cin, message))
+            break;
 
         if (message.empty()) continue;
 
-        send(client_socket, message.c_str(), message.size(), 0);
+        send_command(client_socket, message);
 
         if (message == "/exit") {
             close(client_socket);
@@ -1,471 +1,5338 @@
 #include <iostream>
 #include <string>
+#include <string_view>
+#include <charconv>
 #include <thread>
 #include <mutex>
+#include <shared_mutex>
+#include <atomic>
+#include <memory>
+#include <vector>
+#include <deque>
+#include <chrono>
+#include <sstream>
+#include <functional>
 #include <unordered_map>
 #include <unordered_set>
+#include <filesystem>
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/uio.h>
+#include <sys/eventfd.h>
+#include <sys/timerfd.h>
+#include <sys/resource.h>
+#include <sys/mman.h>
+#include <sys/inotify.h>
+#include <sys/un.h>
+#include <sys/stat.h>
+#include <poll.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <netdb.h>
 #include <arpa/inet.h>
 #include <unistd.h>
+#include <fcntl.h>
 #include <fstream>
+#include <condition_variable>
+#include <crypt.h>
 #include <cstring>
+#include <cerrno>
+#include <cstdint>
 #include <algorithm>
 #include <cctype>
 #include <cstdlib>
 
 #define PORT 12345
-#define BUFFER_SIZE 1024
+#define BUFFER_SIZE 4096       // Bytes requested from the socket per recv.
+#define MAX_FRAME_SIZE 65536   // Longest command accepted from a client.
+#define VARINT_MAX 10          // Longest varint (LEB128) encoding of a 64-bit number.
+#define FRAME_HEADER_MAX (1 + VARINT_MAX) // Longest binary frame header.
+#define KNOWN_NAMES_MAX 1024   // Name ids a binary connection remembers announcing.
+#define RECV_BUFFER_SIZE 65536 // Shard-wide receive buffer (epoll backend).
+#define BUFFER_RETAIN 4096     // Idle reply arenas larger than this are freed.
+#define SLAB_OBJECTS 256       // Connections allocated together by a shard's slab pool.
+#define MAX_EVENTS 256
+#define MAX_IOVECS 64          // Queued messages written per writev-style syscall.
+#define HISTOGRAM_BUCKETS 40   // Histogram bucket i counts values below 2^i.
+#define RING_ENTRIES 1024      // io_uring submission slots per shard.
+#define RING_BUFFERS 512       // io_uring receive buffers per shard (a power of two).
+#define RING_BATCH 64          // io_uring completions handled per round.
+#define TIMER_TICK_MS 100      // Resolution of the connection timers.
+#define TIMER_SLOTS 1024       // Timer wheel slots; one turn of the wheel is about 100 s.
+#define CLOSE_GRACE_MS 2000    // Time a timed-out connection has to take its last reply.
+#define BROADCAST_COST 10      // Rate limit tokens taken by a /broadcast; other messages take one.
+#define MAX_NODES 64           // Nodes in a cluster; node ids are 0 to MAX_NODES - 1.
+#define MAX_PEER_FRAME (1 << 20) // Longest frame accepted from a peer node.
+#define PEER_QUEUE_LIMIT (64 << 20) // Bytes queued for a peer before its link is reset.
+#define PEER_RETRY_MS 1000     // Delay between attempts to reach an unreachable peer.
+#define AUTH_QUEUE_LIMIT 1024  // Logins waiting for an authentication worker.
+#define LOG_SEGMENT_SIZE (16 << 20) // Bytes per message log segment file.
+#define HANDOVER_MAGIC 0x43484154u // Opens a takeover request ("CHAT").
+#define HANDOVER_FDS 250       // Descriptors passed per SCM_RIGHTS message.
+#define HANDOVER_TIMEOUT_S 10  // Wait for the other process during a handover.
 
 using namespace std;
 
+// Hash for string-keyed tables that allows lookups by string_view without building a
+// temporary string.
+struct StringHash
+{
+    using is_transparent = void;
+    size_t operator()(string_view s) const { return hash<string_view>{}(s); }
+};
+
+// Hash table with open addressing and linear probing. Entries are stored inline in one
+// array, next to an array with a metadata byte per slot: 0 for an empty slot, otherwise
+// 0x80 plus seven bits of the entry's hash, so a probe walks consecutive memory and only
+// compares keys whose hash bits match. Nothing is allocated per entry. Erasing shifts
+// the rest of the probe run back instead of leaving tombstones, so lookups never slow
+// down with churn. Lookups take any type that 'Hash' and the key's == accept, e.g. a
+// string_view for string keys. Inserting may move entries, so it invalidates iterators
+// and references; erase(it) returns the iterator to continue from (an entry that
+// wrapped around the end of the table may then be visited twice).
+template <typename Key, typename Value, typename Hash = hash<Key>>
+class FlatMap
+{
+    vector<uint8_t> meta;
+    vector<pair<Key, Value>> slots;
+    size_t used = 0;
+    unsigned shift = 64; // 64 - log2(capacity): the index is the top bits of the mixed hash.
+
+    // Fibonacci hashing spreads keys whose hashes differ only in a few bits, such as
+    // sockets or pointers, over the whole table.
+    uint64_t mix(size_t hash) const { return uint64_t(hash) * 0x9e3779b97f4a7c15ull; }
+    size_t home(uint64_t mixed) const { return mixed >> shift; }
+    uint8_t tag(uint64_t mixed) const { return 0x80 | ((mixed >> (shift - 7)) & 0x7f); }
+    size_t mask() const { return slots.size() - 1; }
+
+    template <typename Lookup>
+    size_t locate(const Lookup &key) const
+    {
+        if (used == 0)
+            return slots.size();
+        uint64_t mixed = mix(Hash{}(key));
+        uint8_t t = tag(mixed);
+        for (size_t i = home(mixed);; i = (i + 1) & mask())
+        {
+            if (meta[i] == 0)
+                return slots.size();
+            if (meta[i] == t && slots[i].first == key)
+                return i;
+        }
+    }
+
+    // Places an entry whose key is not in the table yet, growing the table if needed.
+    size_t place(Key &&key)
+    {
+        if ((used + 1) * 4 > slots.size() * 3)
+            rehash(slots.empty() ? 8 : slots.size() * 2);
+        uint64_t mixed = mix(Hash{}(key));
+        size_t i = home(mixed);
+        while (meta[i] != 0)
+            i = (i + 1) & mask();
+        meta[i] = tag(mixed);
+        slots[i].first = std::move(key);
+        used++;
+        return i;
+    }
+
+    void rehash(size_t capacity)
+    {
+        vector<uint8_t> old_meta(capacity, 0);
+        vector<pair<Key, Value>> old_slots(capacity);
+        old_meta.swap(meta);
+        old_slots.swap(slots);
+        shift = 64 - __builtin_ctzll(capacity);
+        used = 0;
+        for (size_t i = 0; i < old_slots.size(); i++)
+        {
+            if (old_meta[i] != 0)
+                slots[place(std::move(old_slots[i].first))].second = std::move(old_slots[i].second);
+        }
+    }
+
+public:
+    template <typename Table, typename Entry>
+    class Iterator
+    {
+        Table *table;
+        size_t index;
+
+        void skip_empty()
+        {
+            while (index < table->slots.size() && table->meta[index] == 0)
+                index++;
+        }
+
+    public:
+        using iterator_category = forward_iterator_tag;
+        using value_type = pair<Key, Value>;
+        using difference_type = ptrdiff_t;
+        using pointer = Entry *;
+        using reference = Entry &;
+
+        Iterator(Table *t, size_t i) : table(t), index(i) { skip_empty(); }
+        Entry &operator*() const { return table->slots[index]; }
+        Entry *operator->() const { return &table->slots[index]; }
+        Iterator &operator++()
+        {
+            index++;
+            skip_empty();
+            return *this;
+        }
+        bool operator==(const Iterator &other) const { return index == other.index; }
+        bool operator!=(const Iterator &other) const { return index != other.index; }
+        friend class FlatMap;
+    };
+    using iterator = Iterator<FlatMap, pair<Key, Value>>;
+    using const_iterator = Iterator<const FlatMap, const pair<Key, Value>>;
+
+    iterator begin() { return iterator(this, 0); }
+    iterator end() { return iterator(this, slots.size()); }
+    const_iterator begin() const { return const_iterator(this, 0); }
+    const_iterator end() const { return const_iterator(this, slots.size()); }
+    size_t size() const { return used; }
+    bool empty() const { return used == 0; }
+
+    template <typename Lookup>
+    iterator find(const Lookup &key) { return iterator(this, locate(key)); }
+    template <typename Lookup>
+    const_iterator find(const Lookup &key) const { return const_iterator(this, locate(key)); }
+    template <typename Lookup>
+    size_t count(const Lookup &key) const { return locate(key) != slots.size(); }
+
+    // Inserts an entry unless the key is present. Returns the entry and whether it is new.
+    template <typename K, typename... Args>
+    pair<iterator, bool> emplace(K &&key, Args &&...args)
+    {
+        size_t i = locate(key);
+        if (i != slots.size())
+            return {iterator(this, i), false};
+        i = place(Key(std::forward<K>(key)));
+        slots[i].second = Value(std::forward<Args>(args)...);
+        return {iterator(this, i), true};
+    }
+
+    template <typename K>
+    Value &operator[](K &&key) { return emplace(std::forward<K>(key)).first->second; }
+
+    iterator erase(iterator it)
+    {
+        // Move later entries of the probe run into the hole unless that would put them
+        // before their home slot.
+        size_t hole = it.index;
+        for (size_t i = (hole + 1) & mask(); meta[i] != 0; i = (i + 1) & mask())
+        {
+            size_t ideal = home(mix(Hash{}(slots[i].first)));
+            if (((i - ideal) & mask()) >= ((i - hole) & mask()))
+            {
+                meta[hole] = meta[i];
+                slots[hole] = std::move(slots[i]);
+                hole = i;
+            }
+        }
+        meta[hole] = 0;
+        slots[hole] = pair<Key, Value>();
+        used--;
+        return iterator(this, it.index);
+    }
+
+    template <typename Lookup>
+    size_t erase(const Lookup &key)
+    {
+        size_t i = locate(key);
+        if (i == slots.size())
+            return 0;
+        erase(iterator(this, i));
+        return 1;
+    }
+
+    void swap(FlatMap &other)
+    {
+        meta.swap(other.meta);
+        slots.swap(other.slots);
+        std::swap(used, other.used);
+        std::swap(shift, other.shift);
+    }
+};
+
+template <typename Value>
+using StringMap = FlatMap<string, Value, StringHash>;
+
+// Fixed-size object allocator for a single thread. Objects are carved out of slabs of
+// SLAB_OBJECTS and recycled through a free list, so a shard creating and destroying
+// connections does not go through malloc, and its connections sit close together.
+// Slabs are only released with the pool.
+template <typename T>
+class SlabPool
+{
+    union Slot
+    {
+        Slot *next;
+        alignas(T) unsigned char object[sizeof(T)];
+    };
+    vector<unique_ptr<Slot[]>> slabs;
+    Slot *free_slots = nullptr;
+
+public:
+    // Returns an object to its pool.
+    struct Deleter
+    {
+        SlabPool *pool = nullptr;
+        void operator()(T *object) const { pool->destroy(object); }
+    };
+
+    template <typename... Args>
+    T *create(Args &&...args)
+    {
+        if (!free_slots)
+        {
+            slabs.push_back(make_unique<Slot[]>(SLAB_OBJECTS));
+            for (size_t i = 0; i < SLAB_OBJECTS; i++)
+            {
+                slabs.back()[i].next = free_slots;
+                free_slots = &slabs.back()[i];
+            }
+        }
+        Slot *slot = free_slots;
+        free_slots = slot->next;
+        return new (slot->object) T(std::forward<Args>(args)...);
+    }
+
+    void destroy(T *object)
+    {
+        object->~T();
+        Slot *slot = reinterpret_cast<Slot *>(object);
+        slot->next = free_slots;
+        free_slots = slot;
+    }
+};
+
+// Commands understood from authenticated clients, indexing 'command_table'.
+enum class Command
+{
+    Msg,
+    Broadcast,
+    CreateGroup,
+    JoinGroup,
+    GroupMsg,
+    LeaveGroup,
+    Pong,
+    Unknown
+};
+
+#define COMMAND_KINDS 8
+const char *const command_names[COMMAND_KINDS] = {
+    "msg", "broadcast", "create_group", "join_group", "group_msg", "leave_group", "pong", "unknown"};
+
+// --- Metrics ---
+// Every thread that records metrics owns a ThreadMetrics block and is its only writer,
+// so updates are plain relaxed load/store pairs with no locked instructions and no
+// shared cache lines. Readers (the "stats" command and the metrics endpoint) sum the
+// blocks of all threads with relaxed loads, never blocking the writers.
+
+uint64_t now_ns()
+{
+    return chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+struct Counter
+{
+    atomic<uint64_t> value{0};
+
+    void add(uint64_t n = 1) { value.store(value.load(memory_order_relaxed) + n, memory_order_relaxed); }
+    uint64_t get() const { return value.load(memory_order_relaxed); }
+};
+
+// Power-of-two histogram: bucket i counts values v with 2^(i-1) <= v < 2^i (bucket 0
+// counts zeros), which is enough resolution for latencies and sizes.
+struct Histogram
+{
+    Counter buckets[HISTOGRAM_BUCKETS];
+    Counter count;
+    Counter sum;
+
+    void record(uint64_t v)
+    {
+        size_t bucket = v == 0 ? 0 : min<size_t>(64 - __builtin_clzll(v), HISTOGRAM_BUCKETS - 1);
+        buckets[bucket].add();
+        count.add();
+        sum.add(v);
+    }
+};
+
+struct alignas(64) ThreadMetrics
+{
+    Counter commands[COMMAND_KINDS];
+    Histogram command_latency_ns[COMMAND_KINDS];
+    Histogram auth_time_ns;         // From accept to successful login.
+    Histogram fanout_recipients;    // Recipients of each /msg, /broadcast, /group_msg.
+    Histogram queue_depth_bytes;    // Outbound queue size whenever a queue is flushed.
+    Histogram clients_lock_wait_ns; // Waits for a username index stripe lock.
+    Histogram groups_lock_wait_ns;  // Waits for group directory stripe locks.
+    Counter bytes_in;
+    Counter bytes_out;
+    Counter connections_opened;
+    Counter connections_closed;
+    Counter logins;
+    Counter auth_failures;
+    Counter auth_rejected;          // Logins turned away because the auth queue was full.
+    Histogram auth_wait_ns;         // Time a login waits for an authentication worker.
+    Histogram auth_verify_ns;       // Time to check a password.
+    Counter mails_posted;           // Deliveries handed to another shard.
+    Counter messages_dropped;       // Refused by the slow consumer policy.
+    Counter slow_disconnects;
+    Counter io_syscalls;            // Shard epoll_wait, accept4, recv, sendmsg, io_uring_enter calls.
+    Counter log_records;            // Records written to the message log.
+    Counter log_dropped;            // Records discarded after the log could not grow.
+    Histogram log_batch_records;    // Records made durable by each log commit.
+    Histogram log_commit_ns;        // Time to write and sync each log batch.
+    Counter peer_frames_sent;       // Frames written to peer node links.
+    Counter peer_frames_received;
+    Counter peer_writes;            // Syscalls writing to peer links; frames are batched.
+    Counter auth_timeouts;          // Connections that did not log in in time.
+    Counter idle_disconnects;       // Users disconnected after --idle-timeout without commands.
+    Counter pings_sent;
+    Counter heartbeat_timeouts;     // Connections closed for not answering a ping.
+    Counter user_throttled;         // Messages refused by a user's rate limit.
+    Counter group_throttled;        // Messages refused by a group's rate limit.
+};
+
+vector<unique_ptr<ThreadMetrics>> metrics_registry;
+mutex metrics_registry_mutex; // Taken when a thread first records and when reading, never on updates.
+
+// Returns the calling thread's metrics block, registering it on first use.
+ThreadMetrics &local_metrics()
+{
+    thread_local ThreadMetrics *mine = []()
+    {
+        lock_guard<mutex> lock(metrics_registry_mutex);
+        metrics_registry.push_back(make_unique<ThreadMetrics>());
+        return metrics_registry.back().get();
+    }();
+    return *mine;
+}
+
+// Acquires 'lock' (a unique_lock or shared_lock created with defer_lock), recording in
+// 'wait' how long the caller was blocked. Uncontended acquisitions record zero.
+template <typename Lock>
+void lock_timed(Lock &lock, Histogram ThreadMetrics::*wait)
+{
+    if (lock.try_lock())
+    {
+        (local_metrics().*wait).record(0);
+        return;
+    }
+    uint64_t start = now_ns();
+    lock.lock();
+    (local_metrics().*wait).record(now_ns() - start);
+}
+
+// Where an authenticated user's session lives: the owning shard, the socket, and the
+// session id that currently holds the socket (sockets are reused after close, session
+// ids never are).
+struct ClientInfo
+{
+    int shard;
+    int fd;
+    uint64_t session;
+};
+
+// Index from username to the user's session. Usernames are hashed onto lock stripes,
+// each with its own reader-writer lock and hash table, so a lookup costs O(1), only
+// holds one stripe's lock for the duration of a hash probe, and lookups for different
+// users rarely touch the same lock. The reverse direction (session to username) needs
+// no lock: the username is stored in the session's Connection, owned by its shard.
+class ClientIndex
+{
+    static constexpr size_t STRIPES = 64;
+
+    struct alignas(64) Stripe
+    {
+        shared_mutex mutex;
+        StringMap<ClientInfo> sessions;
+    };
+    Stripe stripes[STRIPES];
+
+    Stripe &stripe_for(string_view username)
+    {
+        return stripes[StringHash{}(username) % STRIPES];
+    }
+
+public:
+    // Registers a session for a user. Returns false if the user already has one.
+    bool insert(const string &username, const ClientInfo &info)
+    {
+        Stripe &stripe = stripe_for(username);
+        unique_lock<shared_mutex> lock(stripe.mutex, defer_lock);
+        lock_timed(lock, &ThreadMetrics::clients_lock_wait_ns);
+        return stripe.sessions.emplace(username, info).second;
+    }
+
+    // Looks up a user's session. Returns false if the user is not connected.
+    bool find(string_view username, ClientInfo &info)
+    {
+        Stripe &stripe = stripe_for(username);
+        shared_lock<shared_mutex> lock(stripe.mutex, defer_lock);
+        lock_timed(lock, &ThreadMetrics::clients_lock_wait_ns);
+        auto it = stripe.sessions.find(username);
+        if (it == stripe.sessions.end())
+            return false;
+        info = it->second;
+        return true;
+    }
+
+    // Removes a user's entry if it still belongs to the given session.
+    void erase(const string &username, uint64_t session)
+    {
+        Stripe &stripe = stripe_for(username);
+        unique_lock<shared_mutex> lock(stripe.mutex, defer_lock);
+        lock_timed(lock, &ThreadMetrics::clients_lock_wait_ns);
+        auto it = stripe.sessions.find(username);
+        if (it != stripe.sessions.end() && it->second.session == session)
+            stripe.sessions.erase(it);
+    }
+
+    // Calls 'visit' with the name of every connected user, one stripe at a time.
+    template <typename Visit>
+    void for_each(Visit visit)
+    {
+        for (Stripe &stripe : stripes)
+        {
+            shared_lock<shared_mutex> lock(stripe.mutex);
+            for (auto &entry : stripe.sessions)
+                visit(entry.first);
+        }
+    }
+};
+
+struct Connection;
+
+// The members of a group that one shard owns, packed into a vector so fan-out is a
+// linear scan. Only the owning shard touches 'members'; other shards read 'count' to
+// skip shards without members. Each slot sits on its own cache line.
+struct alignas(64) GroupShard
+{
+    vector<Connection *> members;
+    atomic<size_t> count{0};
+};
+
+// A chat group, with one GroupShard per shard. Groups are never deleted, so pointers
+// to them stay valid for the lifetime of the server. In a cluster, 'remote_nodes' tells
+// which other nodes have members, so group messages are only forwarded to those.
+struct ChatGroup
+{
+    string name;
+    unique_ptr<GroupShard[]> shards;
+    atomic<size_t> local_members{0};  // Members on this node, across all shards.
+    atomic<uint64_t> remote_nodes{0}; // Bit i is set while node i has members.
+    atomic<uint64_t> rate_full_at{0}; // Token bucket shared by the group's senders.
+    uint32_t name_id = 0;             // The group's interned name; see "Binary Protocol".
+};
+
+// Directory from group name to group, striped like ClientIndex. Every /group_msg,
+// /join_group and /leave_group looks its group up, which only takes one stripe's lock
+// shared, so shards do not serialize on the directory; only creating a group takes a
+// stripe exclusively.
+class GroupDirectory
+{
+    static constexpr size_t STRIPES = 64;
+
+    struct alignas(64) Stripe
+    {
+        shared_mutex mutex;
+        StringMap<unique_ptr<ChatGroup>> groups;
+    };
+    Stripe stripes[STRIPES];
+    atomic<size_t> count{0};
+
+    Stripe &stripe_for(string_view name)
+    {
+        return stripes[StringHash{}(name) % STRIPES];
+    }
+
+public:
+    // Returns the group with the given name, or nullptr if it does not exist.
+    ChatGroup *find(string_view name)
+    {
+        Stripe &stripe = stripe_for(name);
+        shared_lock<shared_mutex> lock(stripe.mutex, defer_lock);
+        lock_timed(lock, &ThreadMetrics::groups_lock_wait_ns);
+        auto it = stripe.groups.find(name);
+        return it == stripe.groups.end() ? nullptr : it->second.get();
+    }
+
+    // Adds a group unless one with its name was added first. Returns the group that is
+    // in the directory, and whether it is the one passed in.
+    ChatGroup *insert(unique_ptr<ChatGroup> group, bool &inserted)
+    {
+        Stripe &stripe = stripe_for(group->name);
+        unique_lock<shared_mutex> lock(stripe.mutex, defer_lock);
+        lock_timed(lock, &ThreadMetrics::groups_lock_wait_ns);
+        auto it = stripe.groups.find(group->name);
+        inserted = it == stripe.groups.end();
+        if (!inserted)
+            return it->second.get();
+        ChatGroup *result = group.get();
+        stripe.groups.emplace(result->name, std::move(group));
+        count.fetch_add(1, memory_order_relaxed);
+        return result;
+    }
+
+    size_t size() const
+    {
+        return count.load(memory_order_relaxed);
+    }
+
+    // Calls 'visit' with every group, one stripe at a time.
+    template <typename Visit>
+    void for_each(Visit visit)
+    {
+        for (Stripe &stripe : stripes)
+        {
+            shared_lock<shared_mutex> lock(stripe.mutex);
+            for (auto &entry : stripe.groups)
+                visit(*entry.second);
+        }
+    }
+};
+
+// A user's stored credential: a salted crypt(3) hash such as "$y$...", or, for entries
+// not yet converted with --hash-users, the plaintext password.
+struct Credential
+{
+    string secret;
+    bool hashed;
+};
+
 // Global data structures:
-// - 'clients' maps each client socket to its authenticated username.
-// - 'users' holds valid username:password pairs loaded from a file.
-// - 'groups' maps group names to the set of client sockets that are members.
-unordered_map<int, string> clients;
-mutex clients_mutex;
-unordered_map<string, string> users;
-unordered_map<string, unordered_set<int>> groups;
-mutex groups_mutex;
-
-// Loads user credentials from a file where each line is formatted as "username:password".
-void load_users(const string &filename)
+// - 'clients' maps each authenticated username to its session.
+// - 'users' holds the credentials loaded from the users file; a reload replaces it
+//   as a whole.
+// - 'groups' maps group names to groups; membership is kept per shard in each group.
+//   Groups are never deleted, so a looked-up ChatGroup pointer stays valid.
+// The locks only guard these directories. Message delivery between shards goes
+// through the shard mailboxes and never takes them.
+ClientIndex clients;
+atomic<size_t> active_clients{0}; // Authenticated connections across all shards.
+StringMap<Credential> users;
+shared_mutex users_mutex;
+GroupDirectory groups;
+
+// An immutable, reference-counted message. A fan-out message is formatted once and the
+// same buffer is queued for every recipient, on every shard, until the last one has
+// written it.
+using Payload = shared_ptr<const string>;
+
+// One entry of a connection's outbound queue: 'length' bytes at 'offset' in a shared
+// fan-out message, or, when 'payload' is null, the next 'length' bytes of the
+// connection's reply arena.
+struct OutChunk
+{
+    Payload payload;
+    size_t length;
+    size_t offset;
+};
+
+// A connection's outbound queue, oldest chunk first. Chunks are kept in a vector and
+// taken from 'head', and the vector is only allocated while output is queued (or kept
+// while it is small), so an idle connection's queue costs no heap memory.
+class OutQueue
+{
+    static constexpr size_t RETAIN = 16; // Chunks of capacity kept once the queue drains.
+    vector<OutChunk> chunks;
+    size_t head = 0;
+
+public:
+    bool empty() const { return head == chunks.size(); }
+    OutChunk &front() { return chunks[head]; }
+    OutChunk &back() { return chunks.back(); }
+    vector<OutChunk>::iterator begin() { return chunks.begin() + head; }
+    vector<OutChunk>::iterator end() { return chunks.end(); }
+    vector<OutChunk>::const_iterator begin() const { return chunks.begin() + head; }
+    vector<OutChunk>::const_iterator end() const { return chunks.end(); }
+    void push_back(OutChunk chunk) { chunks.push_back(std::move(chunk)); }
+
+    void pop_front()
+    {
+        chunks[head++].payload.reset();
+        if (head == chunks.size())
+            clear();
+        else if (head >= RETAIN && head * 2 >= chunks.size())
+        {
+            chunks.erase(chunks.begin(), chunks.begin() + head);
+            head = 0;
+        }
+    }
+
+    void clear()
+    {
+        if (chunks.capacity() > RETAIN)
+            vector<OutChunk>().swap(chunks);
+        else
+            chunks.clear();
+        head = 0;
+    }
+};
+
+// Per-connection state owned by the event loop. A connection moves through the
+// authentication states in order and only reaches 'Active' after a successful login.
+enum class ConnState
+{
+    AwaitUsername,
+    AwaitPassword,
+    Authenticating, // The password is being checked by an authentication worker.
+    Active
+};
+
+// What to do when a message would push a connection's outbound queue past
+// 'max_queue_bytes', i.e. when the client reads slower than messages arrive.
+// - Drop: discard the new message.
+// - Disconnect: close the connection and discard everything queued for it.
+// - Coalesce: discard the new message but count it; once the queue drains, the
+//   client receives a single notice saying how many messages it missed.
+enum class SlowPolicy
+{
+    Drop,
+    Disconnect,
+    Coalesce
+};
+
+size_t max_queue_bytes = 1 << 20;
+SlowPolicy slow_policy = SlowPolicy::Drop;
+
+// A token bucket limit: one token every 'interval_ns', holding at most 'capacity_ns'
+// worth of tokens. A bucket's state is the single time at which it will be full again
+// (the generic cell rate algorithm), so taking tokens is one compare and, for a bucket
+// shared between shards, one compare-and-swap. An interval of 0 disables the limit.
+struct RateLimit
+{
+    uint64_t interval_ns = 0;
+    uint64_t capacity_ns = 0;
+
+    void set(double rate, uint64_t burst)
+    {
+        interval_ns = rate > 0 ? uint64_t(1e9 / rate) : 0;
+        capacity_ns = interval_ns * max<uint64_t>(burst, 1);
+    }
+};
+
+RateLimit user_limit;  // Per user, over /msg, /broadcast and /group_msg.
+RateLimit group_limit; // Per group, over /group_msg from all its members.
+
+// Takes 'cost' tokens from a bucket owned by one thread. Returns false, setting
+// 'wait_ns' to the time until they are available, if the bucket holds too few.
+bool take_tokens(uint64_t &full_at, const RateLimit &limit, uint64_t cost, uint64_t now, uint64_t &wait_ns)
+{
+    if (!limit.interval_ns)
+        return true;
+    uint64_t next = max(full_at, now) + cost * limit.interval_ns;
+    if (next - now > limit.capacity_ns)
+    {
+        wait_ns = next - now - limit.capacity_ns;
+        return false;
+    }
+    full_at = next;
+    return true;
+}
+
+// Takes 'cost' tokens from a bucket shared between threads, without locking.
+bool take_tokens(atomic<uint64_t> &full_at, const RateLimit &limit, uint64_t cost, uint64_t now, uint64_t &wait_ns)
+{
+    if (!limit.interval_ns)
+        return true;
+    uint64_t seen = full_at.load(memory_order_relaxed);
+    uint64_t next;
+    do
+    {
+        next = max(seen, now) + cost * limit.interval_ns;
+        if (next - now > limit.capacity_ns)
+        {
+            wait_ns = next - now - limit.capacity_ns;
+            return false;
+        }
+    } while (!full_at.compare_exchange_weak(seen, next, memory_order_relaxed));
+    return true;
+}
+
+// A connection's entry in its shard's timer wheel: an intrusive list node, so that
+// scheduling and cancelling never allocate.
+struct TimerNode
+{
+    TimerNode *prev = nullptr; // Null while the timer is not scheduled.
+    TimerNode *next = nullptr;
+    uint64_t due = 0;          // Wheel tick at which the timer fires.
+    Connection *owner = nullptr;
+};
+
+// How a client delimits its commands on the byte stream.
+// - Line: each command ends with '\n' (a trailing '\r' is ignored).
+// - LengthPrefixed: each command is a 4-byte big-endian length followed by that many
+//   bytes, so commands may contain arbitrary bytes including newlines.
+// - Binary: both directions use binary frames; see "Binary Protocol".
+enum class Framing
+{
+    Line,
+    LengthPrefixed,
+    Binary
+};
+
+// Binary frame types. A frame is its type byte, the varint length of the body, and the
+// body, whose ids are varints too. Users and groups appear as interned name ids.
+// - Text: in either direction, what the text protocol would carry: a command or login
+//   answer from the client; a reply or notice, including "/ping", from the server.
+// - Name (server only): [id][name] tells the client the name behind an id.
+// - Direct: [target id][message] from the client; [sender id][message] to a client.
+// - Broadcast: [message] from the client; [sender id][message] to a client.
+// - Group: [group id][message] in both directions.
+enum class FrameType : uint8_t
+{
+    Text,
+    Name,
+    Direct,
+    Broadcast,
+    Group
+};
+
+struct Connection
+{
+    int fd;
+    uint64_t session;
+    ConnState state = ConnState::AwaitUsername;
+    string username;
+    string inbuf;                // A partial command received so far; usually empty and unallocated.
+    OutQueue outq;               // Output the socket has not accepted yet, oldest first.
+    size_t out_offset = 0;       // Bytes of outq.front() already written.
+    string reply_arena;          // Replies to this client, in queue order. Reused up to BUFFER_RETAIN bytes.
+    size_t arena_consumed = 0;   // Bytes at the start of reply_arena already written.
+    size_t queued_bytes = 0;     // Unwritten bytes across outq.
+    size_t skipped = 0;          // Messages discarded under SlowPolicy::Coalesce.
+    Framing framing = Framing::Line;
+    uint32_t name_id = 0;        // The user's interned name, once logged in.
+    FlatMap<uint32_t, bool> known_names; // Binary framing: name ids the client has been told (values unused).
+    bool close_after_flush = false;
+    bool close_grace = false;    // The timer holds the deadline for flushing the last reply.
+    bool evicted = false;        // Closed as a slow consumer; nothing more is queued.
+    bool read_paused = false;    // Input is left unread until the queue drains.
+    bool dirty = false;          // Listed in the shard's 'dirty' list for flushing.
+    // io_uring backend only: operations in flight keep the connection (and its fd) alive
+    // after it is closed, until their completions arrive.
+    bool recv_armed = false;     // A multishot recv is active.
+    bool send_inflight = false;  // A sendmsg is reading 'send_msg' and the queue front.
+    bool closing = false;        // Closed; freed once nothing is in flight.
+    msghdr send_msg{};
+    unique_ptr<iovec[]> send_iov;
+    uint64_t accepted_at = 0;    // now_ns() when the socket was accepted.
+    TimerNode timer;             // Login deadline, then the idle and heartbeat checks.
+    uint64_t last_input = 0;     // now_ns() when the client last sent anything.
+    uint64_t last_command = 0;   // now_ns() of the client's last command other than /pong.
+    uint64_t ping_sent_at = 0;   // now_ns() of the unanswered ping, or 0.
+    uint64_t rate_full_at = 0;   // The user's token bucket; see RateLimit.
+    FlatMap<ChatGroup *, size_t> joined_groups; // Group -> slot in its member list.
+};
+
+// A connection owned by its shard, which allocates it from the shard's slab pool.
+using ConnectionPtr = unique_ptr<Connection, SlabPool<Connection>::Deleter>;
+
+// A request handed to a shard by another shard or by a worker thread.
+// - Direct: deliver 'payload' to the socket 'fd' if it still belongs to 'session'.
+// - Broadcast: deliver to every active client of the shard except 'session'.
+// - Group: deliver to the shard's members of 'group' except 'session'.
+// - AuthResult: finish the login of 'fd' if it still belongs to 'session'; 'verified'
+//   tells whether the password was correct.
+// - Pause, Freeze, Save: the steps of a hot upgrade; see "Hot Upgrade" below. Resume
+//   undoes them when a handover is abandoned.
+struct Mail
+{
+    enum Kind
+    {
+        Direct,
+        Broadcast,
+        Group,
+        AuthResult,
+        Pause,
+        Freeze,
+        Save,
+        Resume
+    };
+    Kind kind;
+    int fd = -1;
+    uint64_t session = 0;
+    ChatGroup *group = nullptr;
+    Payload payload;
+    Payload binary; // The payload as a binary frame, or null; see "Binary Protocol".
+    bool verified = false;
+    Mail *next = nullptr;
+
+    explicit Mail(Kind k) : kind(k) {}
+};
+
+// Lock-free multi-producer, single-consumer mailbox of items linked through their
+// 'next' field. Producers push onto an intrusive stack with a CAS; the consumer takes
+// the whole stack at once and reverses it to restore arrival order.
+template <typename Item>
+class Mailbox
+{
+    atomic<Item *> head{nullptr};
+
+public:
+    // Returns true if the mailbox was empty, i.e. the consumer needs a wakeup.
+    bool push(Item *mail)
+    {
+        Item *old_head = head.load(memory_order_relaxed);
+        do
+        {
+            mail->next = old_head;
+        } while (!head.compare_exchange_weak(old_head, mail, memory_order_release, memory_order_relaxed));
+        return old_head == nullptr;
+    }
+
+    // Takes every queued item, oldest first.
+    Item *take_all()
+    {
+        Item *list = head.exchange(nullptr, memory_order_acquire);
+        Item *ordered = nullptr;
+        while (list)
+        {
+            Item *next = list->next;
+            list->next = ordered;
+            ordered = list;
+            list = next;
+        }
+        return ordered;
+    }
+};
+
+// --- io_uring Backend ---
+// An io_uring instance driven through the raw system calls. Both rings are mapped into
+// the process, so queuing an operation or reaping a completion is a memory access, and
+// one io_uring_enter per round of events submits everything queued during the round
+// and waits for the next completions. Received data lands in provided buffers shared
+// by all connections of the shard, so an idle connection holds no receive buffer. The
+// buffers are handed to the kernel through a mapped buffer ring, or, on kernels where
+// that does not work, with IORING_OP_PROVIDE_BUFFERS entries submitted with the round.
+class IoRing
+{
+    int ring_fd = -1;
+    void *ring_memory = MAP_FAILED;
+    size_t ring_size = 0;
+    io_uring_sqe *sqes = (io_uring_sqe *)MAP_FAILED;
+    size_t sqes_size = 0;
+    unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+    unsigned sq_entries = 0;
+    unsigned sq_local_tail = 0; // Published to the kernel on the next enter.
+    unsigned pending = 0;       // Entries queued since the last enter.
+    unsigned *cq_head, *cq_tail, *cq_mask;
+    io_uring_cqe *cqes;
+    io_uring_buf_ring *buf_ring = (io_uring_buf_ring *)MAP_FAILED;
+    size_t buf_ring_size = 0;
+    unique_ptr<char[]> buffers;
+    unsigned buffer_count = 0;
+    uint16_t buf_tail = 0;
+    bool use_buf_ring = false;
+
+public:
+    IoRing() = default;
+    IoRing(const IoRing &) = delete;
+    IoRing &operator=(const IoRing &) = delete;
+
+    ~IoRing()
+    {
+        if (buf_ring != MAP_FAILED)
+            munmap(buf_ring, buf_ring_size);
+        if (sqes != MAP_FAILED)
+            munmap(sqes, sqes_size);
+        if (ring_memory != MAP_FAILED)
+            munmap(ring_memory, ring_size);
+        if (ring_fd >= 0)
+            close(ring_fd);
+    }
+
+    // Creates the ring with 'entries' submission slots and provides 'count' receive
+    // buffers of BUFFER_SIZE bytes as buffer group 0 ('count' must be a power of two),
+    // through a buffer ring if 'buffer_ring' is set. Returns false if the kernel does
+    // not support what the backend needs.
+    bool open(unsigned entries, unsigned count, bool buffer_ring)
+    {
+        io_uring_params params{};
+        params.flags = IORING_SETUP_CQSIZE | IORING_SETUP_SUBMIT_ALL | IORING_SETUP_COOP_TASKRUN | IORING_SETUP_SINGLE_ISSUER;
+        params.cq_entries = entries * 4;
+        ring_fd = syscall(__NR_io_uring_setup, entries, &params);
+        if (ring_fd < 0 || !(params.features & IORING_FEAT_SINGLE_MMAP) || !(params.features & IORING_FEAT_NODROP))
+            return false;
+
+        ring_size = max<size_t>(params.sq_off.array + params.sq_entries * sizeof(unsigned),
+                                params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe));
+        ring_memory = mmap(nullptr, ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_SQ_RING);
+        sqes_size = params.sq_entries * sizeof(io_uring_sqe);
+        sqes = (io_uring_sqe *)mmap(nullptr, sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_SQES);
+        if (ring_memory == MAP_FAILED || sqes == MAP_FAILED)
+            return false;
+        char *base = (char *)ring_memory;
+        sq_head = (unsigned *)(base + params.sq_off.head);
+        sq_tail = (unsigned *)(base + params.sq_off.tail);
+        sq_mask = (unsigned *)(base + params.sq_off.ring_mask);
+        sq_array = (unsigned *)(base + params.sq_off.array);
+        sq_entries = params.sq_entries;
+        sq_local_tail = *sq_tail;
+        cq_head = (unsigned *)(base + params.cq_off.head);
+        cq_tail = (unsigned *)(base + params.cq_off.tail);
+        cq_mask = (unsigned *)(base + params.cq_off.ring_mask);
+        cqes = (io_uring_cqe *)(base + params.cq_off.cqes);
+
+        buffer_count = count;
+        buffers = make_unique<char[]>((size_t)count * BUFFER_SIZE);
+        use_buf_ring = buffer_ring;
+        if (!use_buf_ring)
+        {
+            io_uring_sqe *sqe = get_sqe();
+            sqe->opcode = IORING_OP_PROVIDE_BUFFERS;
+            sqe->fd = count;
+            sqe->addr = (uint64_t)(uintptr_t)buffers.get();
+            sqe->len = BUFFER_SIZE;
+            sqe->flags = IOSQE_CQE_SKIP_SUCCESS;
+            return true;
+        }
+        buf_ring_size = count * sizeof(io_uring_buf);
+        buf_ring = (io_uring_buf_ring *)mmap(nullptr, buf_ring_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (buf_ring == MAP_FAILED)
+            return false;
+        io_uring_buf_reg reg{};
+        reg.ring_addr = (uint64_t)(uintptr_t)buf_ring;
+        reg.ring_entries = count;
+        reg.bgid = 0;
+        if (syscall(__NR_io_uring_register, ring_fd, IORING_REGISTER_PBUF_RING, &reg, 1) < 0)
+            return false;
+        for (unsigned id = 0; id < count; id++)
+            recycle(id);
+        return true;
+    }
+
+    // Returns a cleared submission entry, submitting the queued ones first if the ring
+    // is full.
+    io_uring_sqe *get_sqe()
+    {
+        if (sq_local_tail - __atomic_load_n(sq_head, __ATOMIC_ACQUIRE) == sq_entries)
+            submit_and_wait(0);
+        unsigned index = sq_local_tail & *sq_mask;
+        io_uring_sqe *sqe = &sqes[index];
+        memset(sqe, 0, sizeof(*sqe));
+        sq_array[index] = index;
+        sq_local_tail++;
+        pending++;
+        return sqe;
+    }
+
+    // Submits the queued entries and waits until at least 'wait' completions are
+    // available. Returns a negative errno on failure.
+    int submit_and_wait(unsigned wait)
+    {
+        __atomic_store_n(sq_tail, sq_local_tail, __ATOMIC_RELEASE);
+        local_metrics().io_syscalls.add();
+        int ret = syscall(__NR_io_uring_enter, ring_fd, pending, wait, wait ? IORING_ENTER_GETEVENTS : 0, nullptr, 0);
+        if (ret < 0)
+            return -errno;
+        pending = 0;
+        return ret;
+    }
+
+    // Passes up to 'limit' available completions to 'handle', freeing each slot first.
+    template <typename Handler>
+    void reap(Handler handle, unsigned limit = ~0u)
+    {
+        unsigned head = *cq_head;
+        for (unsigned n = 0; n < limit && head != __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE); n++)
+        {
+            io_uring_cqe cqe = cqes[head & *cq_mask];
+            __atomic_store_n(cq_head, ++head, __ATOMIC_RELEASE);
+            handle(cqe);
+        }
+    }
+
+    const char *buffer(unsigned id) const { return buffers.get() + (size_t)id * BUFFER_SIZE; }
+
+    // Hands a receive buffer back to the kernel.
+    void recycle(unsigned id)
+    {
+        if (!use_buf_ring)
+        {
+            io_uring_sqe *sqe = get_sqe();
+            sqe->opcode = IORING_OP_PROVIDE_BUFFERS;
+            sqe->fd = 1;
+            sqe->addr = (uint64_t)(uintptr_t)buffer(id);
+            sqe->len = BUFFER_SIZE;
+            sqe->off = id;
+            sqe->flags = IOSQE_CQE_SKIP_SUCCESS;
+            return;
+        }
+        io_uring_buf &buf = buf_ring->bufs[buf_tail & (buffer_count - 1)];
+        buf.addr = (uint64_t)(uintptr_t)buffer(id);
+        buf.len = BUFFER_SIZE;
+        buf.bid = id;
+        __atomic_store_n(&buf_ring->tail, ++buf_tail, __ATOMIC_RELEASE);
+    }
+};
+
+// --- Timer Wheel ---
+// Each shard keeps one timer per connection in a hashed timing wheel: TIMER_SLOTS lists,
+// with a timer due at tick t stored in slot t % TIMER_SLOTS. Scheduling and cancelling
+// are O(1) list operations. Every TIMER_TICK_MS the wheel advances one slot and fires
+// the timers in it that are due; timers further away than one turn stay in the slot
+// until a later turn.
+class TimerWheel
+{
+    vector<TimerNode> slots; // List heads; each list is circular through its head.
+    uint64_t current = 0;    // Ticks since the wheel started.
+
+public:
+    TimerWheel() : slots(TIMER_SLOTS)
+    {
+        for (TimerNode &head : slots)
+            head.prev = head.next = &head;
+    }
+
+    // Schedules a timer 'delay_ms' from now, replacing any earlier schedule.
+    void schedule(TimerNode &node, uint64_t delay_ms)
+    {
+        cancel(node);
+        node.due = current + max<uint64_t>(1, (delay_ms + TIMER_TICK_MS - 1) / TIMER_TICK_MS);
+        TimerNode &head = slots[node.due % TIMER_SLOTS];
+        node.prev = head.prev;
+        node.next = &head;
+        head.prev->next = &node;
+        head.prev = &node;
+    }
+
+    void cancel(TimerNode &node)
+    {
+        if (!node.prev)
+            return;
+        node.prev->next = node.next;
+        node.next->prev = node.prev;
+        node.prev = node.next = nullptr;
+    }
+
+    // Advances the wheel by one tick, unscheduling the timers that are due and calling
+    // 'fire' with each of their owners.
+    template <typename Fire>
+    void tick(Fire fire)
+    {
+        current++;
+        TimerNode &head = slots[current % TIMER_SLOTS];
+        for (TimerNode *node = head.next; node != &head;)
+        {
+            TimerNode *next = node->next;
+            if (node->due <= current)
+            {
+                cancel(*node);
+                fire(node->owner);
+            }
+            node = next;
+        }
+    }
+};
+
+// Where a shard is in a hot upgrade. A paused shard neither accepts nor reads; a
+// freezing one also starts no sends, and turns quiet once nothing it started is
+// running. A quiet shard only handles mail, and holds its timers, until it is saved
+// and frozen.
+enum class ShardMode
+{
+    Running,
+    Paused,
+    Freezing,
+    Quiet,
+    Frozen
+};
+
+// A reactor thread with its own listening socket (SO_REUSEPORT), epoll instance and
+// connections. With the io_uring backend the shard drives 'ring' instead of epoll.
+struct Shard
+{
+    int id;
+    int epoll_fd = -1;
+    int listen_fd = -1;
+    int wake_fd = -1;
+    int timer_fd = -1;       // Ticks 'timers' every TIMER_TICK_MS.
+    unique_ptr<char[]> recv_buffer; // Epoll backend: RECV_BUFFER_SIZE bytes shared by all reads.
+    Mailbox<Mail> mailbox;
+    unique_ptr<IoRing> ring;
+    TimerWheel timers;
+    SlabPool<Connection> connection_pool;
+    FlatMap<int, ConnectionPtr> connections;
+    vector<pair<int, uint64_t>> evictions; // Slow consumers to close after this round of events.
+    vector<pair<int, uint64_t>> dirty;     // Connections with output queued during this round.
+    ShardMode mode = ShardMode::Running;
+    uint64_t held_ticks = 0;               // Timer ticks held while the shard is quiet.
+    bool accept_armed = false;             // io_uring backend: the multishot accept is active.
+    string handover_state;                 // Serialized connections, frozen or being restored.
+    vector<int> handover_fds;              // Their sockets, in the same order.
+};
+
+vector<unique_ptr<Shard>> shards;
+int listen_port = PORT;       // Client port; --port changes it.
+uint64_t auth_timeout_ms = 30000;     // Time allowed from connecting to logging in.
+uint64_t ping_interval_ms = 60000;    // Silence after which a client is pinged; 0 disables heartbeats.
+uint64_t idle_timeout_ms = 1800000;   // Time without commands before a user is disconnected; 0 disables.
+bool use_io_uring = false;    // Selected with --io-uring when the kernel supports it.
+bool use_buffer_ring = false; // Whether io_uring receive buffers use a buffer ring.
+thread_local Shard *shard = nullptr; // The shard run by the calling thread.
+atomic<uint64_t> next_session{1};
+
+// --- Credential Store ---
+
+// Loads user credentials from a file where each line is formatted as "username:secret".
+// The secret is a crypt(3) hash (starting with '$') or, for files not yet converted
+// with --hash-users, a plaintext password. The new credentials replace the old ones
+// at once, so a reload never exposes a half-read file. Returns false, keeping the
+// current credentials, if the file cannot be opened.
+bool load_users(const string &filename)
+{
+    ifstream file(filename);
+    if (!file.is_open())
+    {
+        cerr << "Error: Unable to open file \"" << filename << "\".\n";
+        return false;
+    }
+    StringMap<Credential> loaded;
+    size_t plaintext = 0;
+    string line;
+    while (getline(file, line))
+    {
+        size_t pos = line.find(':');
+        if (pos != string::npos)
+        {
+            string username = line.substr(0, pos);
+            string secret = line.substr(pos + 1);
+            bool hashed = !secret.empty() && secret[0] == '$';
+            plaintext += !hashed;
+            loaded[username] = Credential{std::move(secret), hashed};
+        }
+    }
+    file.close();
+    if (plaintext > 0)
+        cerr << "Warning: " << plaintext << " plaintext password(s) in \"" << filename
+             << "\"; convert them with --hash-users.\n";
+    unique_lock<shared_mutex> lock(users_mutex);
+    users.swap(loaded);
+    return true;
+}
+
+// Returns true if 'username' has an account.
+bool user_exists(string_view username)
+{
+    shared_lock<shared_mutex> lock(users_mutex);
+    return users.find(username) != users.end();
+}
+
+// Compares two strings in a time that depends only on their lengths.
+bool equal_secrets(string_view a, string_view b)
+{
+    unsigned char diff = a.size() != b.size();
+    for (size_t i = 0; i < a.size() && i < b.size(); i++)
+        diff |= a[i] ^ b[i];
+    return diff == 0;
+}
+
+// Checks a password against a stored credential. Hashes are deliberately slow to
+// compute, so this only runs on the authentication workers.
+bool verify_password(const Credential &credential, const string &password)
+{
+    if (!credential.hashed)
+        return equal_secrets(credential.secret, password);
+    thread_local unique_ptr<crypt_data> data = make_unique<crypt_data>();
+    const char *hash = crypt_rn(password.c_str(), credential.secret.c_str(), data.get(), sizeof(crypt_data));
+    return hash && hash[0] != '*' && equal_secrets(hash, credential.secret);
+}
+
+// Rewrites a users file with every plaintext password replaced by a salted hash of the
+// strongest kind libcrypt offers. The file is replaced with a rename, so a server that
+// is watching it reloads the converted file in one step. Returns false on failure.
+bool hash_users_file(const string &filename)
+{
+    ifstream in(filename);
+    if (!in.is_open())
+    {
+        cerr << "Error: Unable to open file \"" << filename << "\".\n";
+        return false;
+    }
+    string temp_name = filename + ".tmp";
+    ofstream out(temp_name, ios::trunc);
+    auto data = make_unique<crypt_data>();
+    size_t converted = 0;
+    string line;
+    while (getline(in, line))
+    {
+        size_t pos = line.find(':');
+        if (pos != string::npos && pos + 1 < line.size() && line[pos + 1] != '$')
+        {
+            char salt[CRYPT_GENSALT_OUTPUT_SIZE];
+            const char *hash = nullptr;
+            if (crypt_gensalt_rn(nullptr, 0, nullptr, 0, salt, sizeof(salt)))
+                hash = crypt_rn(line.c_str() + pos + 1, salt, data.get(), sizeof(crypt_data));
+            if (!hash || hash[0] == '*')
+            {
+                cerr << "Error: Unable to hash the password of \"" << line.substr(0, pos) << "\".\n";
+                remove(temp_name.c_str());
+                return false;
+            }
+            line = line.substr(0, pos + 1) + hash;
+            converted++;
+        }
+        out << line << '\n';
+    }
+    out.close();
+    if (!out || rename(temp_name.c_str(), filename.c_str()) < 0)
+    {
+        cerr << "Error: Unable to write \"" << filename << "\".\n";
+        return false;
+    }
+    cout << "Hashed " << converted << " password(s) in \"" << filename << "\"." << endl;
+    return true;
+}
+
+// Reloads the users file whenever it is rewritten or replaced. The file's directory is
+// watched rather than the file itself, so that saves done through a rename (as editors
+// and --hash-users do) are noticed too. Runs on a thread of its own.
+void watch_users_file(const string &filename)
+{
+    size_t slash = filename.rfind('/');
+    string dir = slash == string::npos ? "." : filename.substr(0, slash + 1);
+    string base = slash == string::npos ? filename : filename.substr(slash + 1);
+    int fd = inotify_init1(IN_CLOEXEC);
+    if (fd < 0 || inotify_add_watch(fd, dir.c_str(), IN_CLOSE_WRITE | IN_MOVED_TO) < 0)
+    {
+        cerr << "Error: Unable to watch \"" << filename << "\" for changes.\n";
+        return;
+    }
+    alignas(inotify_event) char buffer[BUFFER_SIZE];
+    while (true)
+    {
+        ssize_t n = read(fd, buffer, sizeof(buffer));
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            break;
+        bool changed = false;
+        for (ssize_t pos = 0; pos < n;)
+        {
+            const inotify_event *event = (const inotify_event *)(buffer + pos);
+            if (event->len > 0 && base == event->name)
+                changed = true;
+            pos += sizeof(inotify_event) + event->len;
+        }
+        if (changed && load_users(filename))
+            cout << "Reloaded users from \"" << filename << "\"." << endl;
+    }
+    close(fd);
+}
+
+// Helper function to check if a string contains any spaces.
+bool contains_space(string_view s)
+{
+    return s.find(' ') != string_view::npos;
+}
+
+// Returns true if the connection's outbound queue has reached its limit.
+bool output_full(const Connection &conn)
+{
+    return conn.queued_bytes >= max_queue_bytes;
+}
+
+// Returns true while a connection's input has to wait: its outbound queue is full, its
+// login is still being verified and later commands must not run before it, or its
+// shard is being handed over to a new process.
+bool input_held(const Connection &conn)
+{
+    return output_full(conn) || conn.state == ConnState::Authenticating || shard->mode != ShardMode::Running;
+}
+
+// Writes 'value' as a varint (7 bits per byte, least significant first, the top bit
+// set on all but the last byte) and returns the number of bytes written.
+size_t put_varint(char *out, uint64_t value)
+{
+    size_t n = 0;
+    while (value >= 0x80)
+    {
+        out[n++] = char(value | 0x80);
+        value >>= 7;
+    }
+    out[n++] = char(value);
+    return n;
+}
+
+// Reads a varint from the front of 'in' and removes it. Returns false, leaving 'in'
+// alone, if 'in' does not start with a complete varint.
+bool take_varint(string_view &in, uint64_t &value)
+{
+    value = 0;
+    for (size_t i = 0; i < in.size() && i < VARINT_MAX; i++)
+    {
+        value |= uint64_t((unsigned char)in[i] & 0x7f) << (7 * i);
+        if (!(in[i] & 0x80))
+        {
+            in.remove_prefix(i + 1);
+            return true;
+        }
+    }
+    return false;
+}
+
+// Writes the header of a binary frame with a 'length'-byte body and returns its size.
+size_t frame_header(char *out, FrameType type, size_t length)
+{
+    out[0] = char(type);
+    return 1 + put_varint(out + 1, length);
+}
+
+// Queues a reply for a connection. Replies are formatted straight into the connection's
+// reply arena from any mix of string pieces; defined below with the other senders.
+template <typename... Pieces>
+void send_reply(Connection &conn, const Pieces &...pieces);
+
+// Points 'iov' at up to MAX_IOVECS chunks from the front of the connection's outbound
+// queue. Returns the number of entries filled in and sets 'total' to their size.
+size_t gather_output(const Connection &conn, iovec *iov, size_t &total)
+{
+    size_t count = 0;
+    size_t arena_cursor = conn.arena_consumed;
+    total = 0;
+    for (auto it = conn.outq.begin(); it != conn.outq.end() && count < MAX_IOVECS; ++it, ++count)
+    {
+        size_t offset = count == 0 ? conn.out_offset : 0;
+        const char *data = it->payload ? it->payload->data() + it->offset : conn.reply_arena.data() + arena_cursor;
+        if (!it->payload)
+            arena_cursor += it->length;
+        iov[count].iov_base = (void *)(data + offset);
+        iov[count].iov_len = it->length - offset;
+        total += iov[count].iov_len;
+    }
+    return count;
+}
+
+// Accounts for 'n' bytes of the outbound queue having been written.
+void consume_output(Connection &conn, size_t n)
+{
+    // Release every chunk written in full; keep the offset into a partial one.
+    local_metrics().bytes_out.add(n);
+    conn.queued_bytes -= n;
+    size_t remaining = n + conn.out_offset;
+    while (!conn.outq.empty() && remaining >= conn.outq.front().length)
+    {
+        remaining -= conn.outq.front().length;
+        if (!conn.outq.front().payload)
+            conn.arena_consumed += conn.outq.front().length;
+        conn.outq.pop_front();
+    }
+    conn.out_offset = remaining;
+
+    // Reuse the arena once everything in it is written, and compact it when most
+    // of it has been.
+    if (conn.arena_consumed == conn.reply_arena.size())
+    {
+        if (conn.reply_arena.capacity() > BUFFER_RETAIN)
+            string().swap(conn.reply_arena); // Don't keep memory grown by a burst.
+        else
+            conn.reply_arena.clear();
+        conn.arena_consumed = 0;
+    }
+    else if (conn.arena_consumed > BUFFER_SIZE && conn.arena_consumed * 2 > conn.reply_arena.size())
+    {
+        conn.reply_arena.erase(0, conn.arena_consumed);
+        conn.arena_consumed = 0;
+    }
+
+    // Tell a coalescing slow consumer what it missed once it has caught up.
+    if (conn.outq.empty() && conn.skipped > 0)
+    {
+        char count_text[24];
+        string_view skipped(count_text, to_chars(count_text, count_text + sizeof(count_text), conn.skipped).ptr - count_text);
+        conn.skipped = 0;
+        send_reply(conn, "Notice: ", skipped, " message(s) were skipped because your connection is too slow.\n");
+    }
+}
+
+// Operations queued on a shard's io_uring. Each completion carries its operation in
+// the low bits of its user data and, for per-connection operations, the Connection
+// address in the rest.
+enum RingOp : uint64_t
+{
+    OpIgnore = 0, // Cancellations.
+    OpAccept,
+    OpWake,
+    OpRecv,
+    OpSend,
+    OpTimer,
+    OpMask = 7
+};
+
+uint64_t ring_tag(const Connection &conn, RingOp op)
+{
+    return (uint64_t)(uintptr_t)&conn | op;
+}
+
+// Starts a multishot recv that delivers the connection's input into provided buffers
+// until it is cancelled or the peer closes.
+void arm_recv(Connection &conn)
+{
+    io_uring_sqe *sqe = shard->ring->get_sqe();
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = conn.fd;
+    sqe->ioprio = IORING_RECV_MULTISHOT;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = 0;
+    sqe->user_data = ring_tag(conn, OpRecv);
+    conn.recv_armed = true;
+}
+
+// Stops the connection's multishot recv; it completes with -ECANCELED.
+void cancel_recv(Connection &conn)
+{
+    if (!conn.recv_armed)
+        return;
+    io_uring_sqe *sqe = shard->ring->get_sqe();
+    sqe->opcode = IORING_OP_ASYNC_CANCEL;
+    sqe->addr = ring_tag(conn, OpRecv);
+    sqe->user_data = OpIgnore;
+}
+
+// Cancels the connection's sendmsg, if one is in flight. Bytes it has not sent stay
+// at the front of the queue.
+void cancel_send(Connection &conn)
+{
+    if (!conn.send_inflight)
+        return;
+    io_uring_sqe *sqe = shard->ring->get_sqe();
+    sqe->opcode = IORING_OP_ASYNC_CANCEL;
+    sqe->addr = ring_tag(conn, OpSend);
+    sqe->user_data = OpIgnore;
+}
+
+// Queues a gathered sendmsg of the front of the connection's outbound queue. Until it
+// completes the queue front must stay put, so reply arena bytes are first moved into a
+// shared buffer the arena can no longer reallocate or compact.
+void submit_send(Connection &conn)
+{
+    if (conn.arena_consumed < conn.reply_arena.size())
+    {
+        Payload frozen = make_shared<const string>(conn.reply_arena, conn.arena_consumed);
+        size_t cursor = 0;
+        for (OutChunk &chunk : conn.outq)
+        {
+            if (!chunk.payload)
+            {
+                chunk.payload = frozen;
+                chunk.offset = cursor;
+                cursor += chunk.length;
+            }
+        }
+    }
+    conn.reply_arena.clear();
+    conn.arena_consumed = 0;
+
+    if (!conn.send_iov)
+        conn.send_iov = make_unique<iovec[]>(MAX_IOVECS);
+    size_t total;
+    conn.send_msg = msghdr{};
+    conn.send_msg.msg_iov = conn.send_iov.get();
+    conn.send_msg.msg_iovlen = gather_output(conn, conn.send_iov.get(), total);
+
+    io_uring_sqe *sqe = shard->ring->get_sqe();
+    sqe->opcode = IORING_OP_SENDMSG;
+    sqe->fd = conn.fd;
+    sqe->addr = (uint64_t)(uintptr_t)&conn.send_msg;
+    sqe->len = 1;
+    sqe->msg_flags = MSG_NOSIGNAL;
+    sqe->user_data = ring_tag(conn, OpSend);
+    conn.send_inflight = true;
+}
+
+// Writes as much of the connection's outbound queue as the socket accepts without
+// blocking, gathering up to MAX_IOVECS queued chunks into each sendmsg call. With the
+// io_uring backend the send is only queued on the ring, one at a time per connection,
+// unless the flush is 'urgent' (the queue is filling up within a round) and no ring
+// send is in flight, in which case it is written directly as with epoll.
+// Returns false if the peer is gone and the connection should be closed.
+bool flush_connection(Connection &conn, bool urgent = false)
+{
+    if (!conn.outq.empty())
+        local_metrics().queue_depth_bytes.record(conn.queued_bytes);
+    if (shard->ring && (!urgent || conn.send_inflight))
+    {
+        if (!conn.send_inflight && !conn.outq.empty() &&
+            (shard->mode == ShardMode::Running || shard->mode == ShardMode::Paused))
+            submit_send(conn);
+        return true;
+    }
+    while (!conn.outq.empty())
+    {
+        iovec iov[MAX_IOVECS];
+        size_t total;
+        msghdr msg{};
+        msg.msg_iov = iov;
+        msg.msg_iovlen = gather_output(conn, iov, total);
+        ssize_t n = sendmsg(conn.fd, &msg, MSG_NOSIGNAL);
+        local_metrics().io_syscalls.add();
+        if (n < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            return errno == EAGAIN || errno == EWOULDBLOCK;
+        }
+        consume_output(conn, n);
+        if ((size_t)n < total)
+            break; // The socket buffer is full; wait for EPOLLOUT.
+    }
+    return true;
+}
+
+// Lists a connection for flushing at the end of the current round of events.
+void mark_dirty(Connection &conn)
+{
+    if (!conn.dirty)
+    {
+        conn.dirty = true;
+        shard->dirty.emplace_back(conn.fd, conn.session);
+    }
+}
+
+// Decides whether 'length' more bytes may be queued for a connection. A message that
+// would overflow the queue is handled according to 'slow_policy', so delivering to a
+// slow reader never blocks the shard.
+bool admit_output(Connection &conn, size_t length)
+{
+    if (conn.evicted)
+        return false;
+    if (conn.outq.empty() || conn.queued_bytes + length <= max_queue_bytes)
+        return true;
+    switch (slow_policy)
+    {
+    case SlowPolicy::Drop:
+        local_metrics().messages_dropped.add();
+        break;
+    case SlowPolicy::Coalesce:
+        local_metrics().messages_dropped.add();
+        conn.skipped++;
+        break;
+    case SlowPolicy::Disconnect:
+        local_metrics().slow_disconnects.add();
+        conn.evicted = true;
+        shard->evictions.emplace_back(conn.fd, conn.session);
+        if (conn.send_inflight)
+            break; // The ring is still reading the queue; it goes with the connection.
+        conn.outq.clear();
+        conn.queued_bytes = 0;
+        conn.reply_arena.clear();
+        conn.arena_consumed = 0;
+        break;
+    }
+    return false;
+}
+
+// Accounts for 'length' newly queued bytes. Queued output is written at the end of the
+// current round of events, so everything a connection receives in one round goes out in
+// a single syscall; whatever the socket does not accept then is written when epoll
+// reports the socket writable again.
+void output_queued(Connection &conn, size_t length)
+{
+    conn.queued_bytes += length;
+    mark_dirty(conn);
+
+    // Don't let a burst within one round fill the queue while the socket could take it.
+    if (conn.queued_bytes >= max_queue_bytes / 2)
+        flush_connection(conn, true);
+}
+
+// Appends 'length' bytes of pieces to the connection's reply arena. Consecutive
+// replies share one queue entry, so replying needs no allocation once the arena has
+// grown to fit. The caller has admitted the bytes and accounts for them.
+template <typename... Pieces>
+void append_reply(Connection &conn, size_t length, const Pieces &...pieces)
+{
+    (conn.reply_arena.append(string_view(pieces)), ...);
+    if (!conn.outq.empty() && !conn.outq.back().payload)
+        conn.outq.back().length += length;
+    else
+        conn.outq.push_back(OutChunk{nullptr, length, 0});
+}
+
+// Queues a shared message for a connection. A binary client gets it in a Text frame,
+// whose header goes into the reply arena, so the message itself is still shared.
+void send_message(Connection &conn, const Payload &message)
+{
+    size_t length = message->size();
+    char header[FRAME_HEADER_MAX];
+    size_t header_length = conn.framing == Framing::Binary ? frame_header(header, FrameType::Text, length) : 0;
+    if (!admit_output(conn, header_length + length))
+        return;
+    if (header_length)
+        append_reply(conn, header_length, string_view(header, header_length));
+    conn.outq.push_back(OutChunk{message, length, 0});
+    output_queued(conn, header_length + length);
+}
+
+// Replies to a binary client are framed as Text frames.
+template <typename... Pieces>
+void send_reply(Connection &conn, const Pieces &...pieces)
+{
+    size_t length = (string_view(pieces).size() + ...);
+    char header[FRAME_HEADER_MAX];
+    size_t header_length = conn.framing == Framing::Binary ? frame_header(header, FrameType::Text, length) : 0;
+    if (!admit_output(conn, header_length + length))
+        return;
+    append_reply(conn, header_length + length, string_view(header, header_length), pieces...);
+    output_queued(conn, header_length + length);
+}
+
+// Formats a message for fan-out into a shared buffer with a single allocation for
+// its contents.
+template <typename... Pieces>
+Payload make_payload(const Pieces &...pieces)
+{
+    string text;
+    text.reserve((string_view(pieces).size() + ...));
+    (text.append(string_view(pieces)), ...);
+    return make_shared<const string>(std::move(text));
+}
+
+// --- Binary Protocol ---
+// A client that sends "/frame binary" switches its connection to binary frames (see
+// FrameType), in place of text lines. Commands and messages then need no tokenizing,
+// and user and group names are replaced by interned ids: each name gets a number for
+// the lifetime of the server, and a client is sent a Name frame for an id before the
+// first frame that uses it. Fan-out messages are formatted once more, as a binary
+// frame shared by every binary recipient, but only while binary clients are connected.
+// Everything else reaches binary clients as Text frames.
+
+deque<string> interned_names;   // Indexed by id; never shrinks, so entries stay put.
+StringMap<uint32_t> name_ids;
+shared_mutex names_mutex;
+atomic<size_t> binary_clients{0}; // Connections using binary framing, across all shards.
+
+// Returns the id of a name, assigning the next one if it has none yet.
+uint32_t intern_name(string_view name)
+{
+    {
+        shared_lock<shared_mutex> lock(names_mutex);
+        auto it = name_ids.find(name);
+        if (it != name_ids.end())
+            return it->second;
+    }
+    unique_lock<shared_mutex> lock(names_mutex);
+    auto it = name_ids.find(name);
+    if (it != name_ids.end())
+        return it->second;
+    uint32_t id = interned_names.size();
+    interned_names.emplace_back(name);
+    name_ids.emplace(name, id);
+    return id;
+}
+
+// Looks up the name behind an id. Returns false if no name has that id.
+bool interned_name(uint64_t id, string_view &name)
+{
+    shared_lock<shared_mutex> lock(names_mutex);
+    if (id >= interned_names.size())
+        return false;
+    name = interned_names[id];
+    return true;
+}
+
+// Formats a fan-out message as a binary frame of the given type whose body is 'id'
+// and the message. Returns null, skipping the work, while no binary client is connected.
+Payload make_frame(FrameType type, uint32_t id, string_view message)
+{
+    if (binary_clients.load(memory_order_relaxed) == 0)
+        return nullptr;
+    char id_bytes[VARINT_MAX];
+    size_t id_length = put_varint(id_bytes, id);
+    char header[FRAME_HEADER_MAX];
+    size_t header_length = frame_header(header, type, id_length + message.size());
+    return make_payload(string_view(header, header_length), string_view(id_bytes, id_length), message);
+}
+
+// Tells a binary client the name behind an id, unless it has been told already. A
+// connection remembers at most KNOWN_NAMES_MAX ids, then forgets them all and announces
+// names again as they come up; ids never change, so those the client knows stay valid.
+void announce_name(Connection &conn, uint64_t id)
+{
+    string_view name;
+    if (conn.framing != Framing::Binary)
+        return;
+    if (conn.known_names.size() >= KNOWN_NAMES_MAX && conn.known_names.find(id) == conn.known_names.end())
+        FlatMap<uint32_t, bool>().swap(conn.known_names);
+    if (!conn.known_names.emplace(id, true).second || !interned_name(id, name))
+        return;
+    char id_bytes[VARINT_MAX];
+    size_t id_length = put_varint(id_bytes, id);
+    char header[FRAME_HEADER_MAX];
+    size_t header_length = frame_header(header, FrameType::Name, id_length + name.size());
+    size_t length = header_length + id_length + name.size();
+    append_reply(conn, length, string_view(header, header_length), string_view(id_bytes, id_length), name);
+    output_queued(conn, length);
+}
+
+// Queues a binary fan-out frame from make_frame, announcing its id first if needed.
+void send_frame(Connection &conn, const Payload &frame)
+{
+    if (!admit_output(conn, frame->size()))
+        return;
+    string_view body(*frame);
+    body.remove_prefix(1);
+    uint64_t length, id;
+    if (take_varint(body, length) && take_varint(body, id))
+        announce_name(conn, id);
+    conn.outq.push_back(OutChunk{frame, frame->size(), 0});
+    output_queued(conn, frame->size());
+}
+
+// Queues a fan-out message in the form the connection uses.
+void deliver(Connection &conn, const Mail &mail)
+{
+    if (mail.binary && conn.framing == Framing::Binary)
+        send_frame(conn, mail.binary);
+    else
+        send_message(conn, mail.payload);
+}
+
+// Changes how a connection frames its traffic, keeping count of binary connections.
+void set_framing(Connection &conn, Framing framing)
+{
+    if (conn.framing == Framing::Binary)
+        binary_clients.fetch_sub(1, memory_order_relaxed);
+    if (framing == Framing::Binary)
+        binary_clients.fetch_add(1, memory_order_relaxed);
+    conn.framing = framing;
+}
+
+// Completes a login once its password has been checked; defined below with the
+// authentication handlers.
+void finish_auth(Connection &conn, bool verified);
+
+// Stops the calling shard accepting and reading for a hot upgrade, starts freezing it,
+// saves it, and undoes all of these; defined below.
+void pause_shard();
+void start_freeze();
+void save_shard();
+void resume_shard();
+
+// Delivers a mail to the connections of the calling thread's shard.
+void handle_mail(const Mail &mail)
+{
+    switch (mail.kind)
+    {
+    case Mail::Direct:
+    {
+        auto it = shard->connections.find(mail.fd);
+        if (it != shard->connections.end() && it->second->session == mail.session)
+            deliver(*it->second, mail);
+        break;
+    }
+    case Mail::Broadcast:
+        for (auto &entry : shard->connections)
+        {
+            Connection &conn = *entry.second;
+            if (conn.state == ConnState::Active && conn.session != mail.session)
+                deliver(conn, mail);
+        }
+        break;
+    case Mail::Group:
+        for (Connection *member : mail.group->shards[shard->id].members)
+        {
+            if (member->session != mail.session)
+                deliver(*member, mail);
+        }
+        break;
+    case Mail::AuthResult:
+    {
+        auto it = shard->connections.find(mail.fd);
+        if (it != shard->connections.end() && it->second->session == mail.session)
+            finish_auth(*it->second, mail.verified);
+        break;
+    }
+    case Mail::Pause:
+        pause_shard();
+        break;
+    case Mail::Freeze:
+        start_freeze();
+        break;
+    case Mail::Save:
+        if (shard->mode == ShardMode::Quiet)
+            save_shard();
+        break;
+    case Mail::Resume:
+        if (shard->mode != ShardMode::Running)
+            resume_shard();
+        break;
+    }
+}
+
+// Hands a mail to its destination shard. Mail for the calling shard is delivered
+// immediately; otherwise it is queued and the destination woken if it was idle.
+// Threads other than the shards (the log writer, the authentication workers) always queue.
+void post_mail(int shard_id, Mail *mail)
+{
+    if (shard && shard_id == shard->id)
+    {
+        handle_mail(*mail);
+        delete mail;
+        return;
+    }
+    local_metrics().mails_posted.add();
+    Shard &dest = *shards[shard_id];
+    if (dest.mailbox.push(mail))
+    {
+        uint64_t one = 1;
+        ssize_t ignored = write(dest.wake_fd, &one, sizeof(one));
+        (void)ignored;
+    }
+}
+
+// Delivers every mail queued for the calling shard.
+void drain_mailbox()
+{
+    uint64_t count;
+    while (read(shard->wake_fd, &count, sizeof(count)) > 0)
+        ;
+    Mail *mail = shard->mailbox.take_all();
+    while (mail)
+    {
+        Mail *next = mail->next;
+        handle_mail(*mail);
+        delete mail;
+        mail = next;
+    }
+}
+
+// Sends a message to one client, wherever its socket lives. 'binary' is the message
+// as a binary frame, if the sender made one.
+void send_to_client(const ClientInfo &target, const Payload &message, const Payload &binary = nullptr)
+{
+    Mail *mail = new Mail(Mail::Direct);
+    mail->fd = target.fd;
+    mail->session = target.session;
+    mail->payload = message;
+    mail->binary = binary;
+    post_mail(target.shard, mail);
+}
+
+// --- Message Log ---
+// With --log-dir, group messages and private messages are appended to a log made of
+// fixed-size segment files, each memory-mapped and named after the sequence number of
+// its first record. Shards only push records onto the log writer's lock-free queue;
+// the writer thread copies everything queued since its last pass into the mapped
+// segment and makes the whole batch durable with one msync (group commit), so the live
+// fan-out never waits on the disk. The writer also maintains two in-memory indexes of
+// record locations, rebuilt from the segments on startup: the last 'history_length'
+// messages of every group, replayed on /join_group, and the private messages waiting
+// for offline users, delivered when they log in.
+
+enum class LogKind : uint8_t
+{
+    Group = 1, // Key: group name.
+    Private,   // Key: recipient, who was online. Kept for the record only.
+    Offline,   // Key: recipient, who was offline. Pending until delivered.
+    Delivered  // Key: recipient. Text: sequence number of the last delivered record.
+};
+
+// On-disk record header, followed by 'key_length' bytes of key and then the text.
+// Segments are zero-filled, so a zero 'length' marks the end of the records.
+struct LogHeader
+{
+    uint64_t seq;
+    uint32_t length;   // Bytes of key and text after the header.
+    uint32_t checksum; // FNV-1a over the sequence number, kind, key and text.
+    uint16_t key_length;
+    LogKind kind;
+    uint8_t reserved[5];
+};
+
+// A record queued for the log writer.
+struct LogRecord
+{
+    LogKind kind;
+    string key;
+    Payload text;
+    LogRecord *next = nullptr;
+};
+
+struct LogSegment
+{
+    uint64_t base_seq;
+    char *data;
+    size_t used = 0; // Bytes of records written; only the log writer appends.
+};
+
+// Where a record lives in the log.
+struct LogLocation
+{
+    uint32_t segment;
+    uint32_t offset;
+    uint64_t seq;
+};
+
+string log_dir;              // Empty when the message log is disabled.
+size_t history_length = 20;  // Group messages replayed on /join_group.
+Mailbox<LogRecord> log_queue;
+int log_wake_fd = -1;
+uint64_t log_next_seq = 1;   // Owned by the log writer after startup.
+vector<LogSegment> log_segments;
+shared_mutex log_index_mutex; // Guards 'log_segments' against growth and both indexes.
+StringMap<deque<LogLocation>> group_history;
+StringMap<vector<LogLocation>> offline_messages;
+atomic<size_t> log_pending{0};  // Records queued but not yet written.
+atomic<bool> log_sealed{false}; // Set while a new process takes over the log.
+atomic<bool> log_disabled{false}; // Set when the log cannot grow (e.g. the disk is full).
+
+uint32_t log_checksum(const LogHeader &header, string_view key, string_view text)
+{
+    uint32_t hash = 2166136261u;
+    auto mix = [&hash](const void *data, size_t size)
+    {
+        for (size_t i = 0; i < size; i++)
+            hash = (hash ^ ((const unsigned char *)data)[i]) * 16777619u;
+    };
+    mix(&header.seq, sizeof(header.seq));
+    mix(&header.kind, sizeof(header.kind));
+    mix(key.data(), key.size());
+    mix(text.data(), text.size());
+    return hash;
+}
+
+// Returns the text of a logged record. Callers hold 'log_index_mutex'.
+string_view log_text(const LogLocation &location)
+{
+    const char *record = log_segments[location.segment].data + location.offset;
+    LogHeader header;
+    memcpy(&header, record, sizeof(header));
+    return string_view(record + sizeof(header) + header.key_length, header.length - header.key_length);
+}
+
+// Queues a record for the log writer. Does nothing when the log is off, sealed or
+// disabled after a write error.
+void log_append(LogKind kind, string_view key, const Payload &text)
+{
+    if (log_dir.empty())
+        return;
+    if (log_disabled.load(memory_order_relaxed))
+    {
+        local_metrics().log_dropped.add();
+        return;
+    }
+    // Counted before the seal is checked, so once a sealed log has no pending records,
+    // none can follow.
+    log_pending.fetch_add(1);
+    if (log_sealed.load())
+    {
+        log_pending.fetch_sub(1);
+        return;
+    }
+    LogRecord *record = new LogRecord{kind, string(key), text};
+    if (log_queue.push(record))
+    {
+        uint64_t one = 1;
+        ssize_t ignored = write(log_wake_fd, &one, sizeof(one));
+        (void)ignored;
+    }
+}
+
+// Maps the segment file whose first record is 'base_seq', creating it if needed.
+bool open_segment(uint64_t base_seq)
+{
+    char name[32];
+    snprintf(name, sizeof(name), "%020llu.log", (unsigned long long)base_seq);
+    string path = log_dir + "/" + name;
+    int fd = open(path.c_str(), O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC, 0644);
+    bool created = fd >= 0;
+    if (!created && errno == EEXIST)
+        fd = open(path.c_str(), O_RDWR | O_CLOEXEC);
+    // Allocated in full up front, so a full disk fails here rather than in a write to
+    // the mapping (which would raise SIGBUS). A segment that could not be allocated is
+    // removed again, so recovery never maps a short file.
+    if (fd < 0 || posix_fallocate(fd, 0, LOG_SEGMENT_SIZE) != 0)
+    {
+        cerr << "Error: Unable to open log segment " << path << ".\n";
+        if (fd >= 0)
+            close(fd);
+        if (created)
+            unlink(path.c_str());
+        return false;
+    }
+    void *data = mmap(nullptr, LOG_SEGMENT_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED)
+    {
+        cerr << "Error: Unable to map log segment " << path << ".\n";
+        return false;
+    }
+    unique_lock<shared_mutex> lock(log_index_mutex);
+    log_segments.push_back(LogSegment{base_seq, (char *)data});
+    return true;
+}
+
+// Applies a record to the indexes. Callers hold 'log_index_mutex' exclusively.
+void index_record(LogKind kind, string_view key, string_view text, const LogLocation &location)
+{
+    switch (kind)
+    {
+    case LogKind::Group:
+    {
+        auto it = group_history.find(key);
+        if (it == group_history.end())
+            it = group_history.emplace(string(key), deque<LogLocation>()).first;
+        it->second.push_back(location);
+        while (it->second.size() > history_length)
+            it->second.pop_front();
+        break;
+    }
+    case LogKind::Offline:
+    {
+        auto it = offline_messages.find(key);
+        if (it == offline_messages.end())
+            it = offline_messages.emplace(string(key), vector<LogLocation>()).first;
+        it->second.push_back(location);
+        break;
+    }
+    case LogKind::Delivered:
+    {
+        auto it = offline_messages.find(key);
+        uint64_t delivered = 0;
+        from_chars(text.data(), text.data() + text.size(), delivered);
+        if (it == offline_messages.end())
+            break;
+        auto &pending = it->second;
+        pending.erase(pending.begin(), find_if(pending.begin(), pending.end(), [delivered](const LogLocation &l)
+                                               { return l.seq > delivered; }));
+        if (pending.empty())
+            offline_messages.erase(it);
+        break;
+    }
+    case LogKind::Private:
+        break;
+    }
+}
+
+// Maps the existing segments and rebuilds the indexes from their records. Reading
+// stops at the first record that is torn or out of sequence; the rest of that segment
+// is cleared and later segments are discarded, so appends continue from there.
+bool recover_log()
+{
+    error_code error;
+    filesystem::create_directories(log_dir, error);
+    vector<uint64_t> bases;
+    for (const auto &entry : filesystem::directory_iterator(log_dir, error))
+    {
+        string name = entry.path().filename().string();
+        if (name.size() == 24 && name.compare(20, 4, ".log") == 0)
+            bases.push_back(strtoull(name.c_str(), nullptr, 10));
+    }
+    if (error)
+    {
+        cerr << "Error: Unable to read log directory " << log_dir << ".\n";
+        return false;
+    }
+    sort(bases.begin(), bases.end());
+
+    unique_lock<shared_mutex> lock(log_index_mutex, defer_lock);
+    for (size_t i = 0; i < bases.size(); i++)
+    {
+        if (!open_segment(bases[i]))
+            return false;
+        lock.lock();
+        LogSegment &segment = log_segments.back();
+        uint64_t expected = segment.base_seq;
+        size_t offset = 0;
+        bool intact = i == 0 || segment.base_seq == log_next_seq;
+        while (intact && offset + sizeof(LogHeader) <= LOG_SEGMENT_SIZE)
+        {
+            LogHeader header;
+            memcpy(&header, segment.data + offset, sizeof(header));
+            size_t end = offset + sizeof(header) + header.length;
+            if (header.length == 0)
+                break;
+            string_view key(segment.data + offset + sizeof(header), min<size_t>(header.key_length, header.length));
+            if (end > LOG_SEGMENT_SIZE || header.key_length > header.length || header.seq != expected ||
+                header.checksum != log_checksum(header, key, string_view(key.end(), header.length - key.size())))
+            {
+                intact = false;
+                break;
+            }
+            index_record(header.kind, key, string_view(key.end(), header.length - key.size()),
+                         LogLocation{(uint32_t)(log_segments.size() - 1), (uint32_t)offset, header.seq});
+            expected++;
+            offset = end;
+        }
+        segment.used = offset;
+        log_next_seq = expected;
+        lock.unlock();
+        if (!intact)
+        {
+            memset(segment.data + offset, 0, LOG_SEGMENT_SIZE - offset);
+            for (size_t j = i + 1; j < bases.size(); j++)
+            {
+                char name[32];
+                snprintf(name, sizeof(name), "%020llu.log", (unsigned long long)bases[j]);
+                filesystem::remove(log_dir + "/" + name, error);
+            }
+            break;
+        }
+    }
+    return !log_segments.empty() || open_segment(log_next_seq);
+}
+
+// Writes one record at the end of the current segment, starting a new segment when
+// it does not fit, and stores where it went in 'location'. If no new segment can be
+// created, the log is disabled and false is returned; chat goes on without it.
+bool write_record(const LogRecord &record, LogLocation &location)
+{
+    string_view text = *record.text;
+    LogHeader header{};
+    header.seq = log_next_seq;
+    header.kind = record.kind;
+    header.key_length = record.key.size();
+    header.length = record.key.size() + text.size();
+    header.checksum = log_checksum(header, record.key, text);
+    if (log_segments.back().used + sizeof(header) + header.length > LOG_SEGMENT_SIZE && !open_segment(header.seq))
+    {
+        cerr << "Error: Unable to grow the message log; logging stops.\n";
+        log_disabled.store(true);
+        return false;
+    }
+    log_next_seq++;
+    LogSegment &segment = log_segments.back();
+    char *out = segment.data + segment.used;
+    memcpy(out, &header, sizeof(header));
+    memcpy(out + sizeof(header), record.key.data(), record.key.size());
+    memcpy(out + sizeof(header) + record.key.size(), text.data(), text.size());
+    location = LogLocation{(uint32_t)(log_segments.size() - 1), (uint32_t)segment.used, header.seq};
+    segment.used += sizeof(header) + header.length;
+    return true;
+}
+
+// A logged private message whose recipient has come online, to be delivered directly.
+struct OfflineDelivery
+{
+    ClientInfo target;
+    LogRecord *record;
+    uint64_t seq;
+};
+
+// Log writer thread: commits every batch of queued records with one msync per segment
+// touched, then publishes them to the indexes. A private message for a user who logged
+// in while it was queued is delivered right away instead of waiting for the next login.
+// Once the log is disabled, queued records are dropped and counted.
+void run_log_writer()
+{
+    const size_t page_size = sysconf(_SC_PAGESIZE);
+    vector<LogLocation> locations;
+    vector<OfflineDelivery> deliveries;
+    while (true)
+    {
+        uint64_t count;
+        if (read(log_wake_fd, &count, sizeof(count)) < 0 && errno != EAGAIN)
+            continue;
+        LogRecord *batch = log_queue.take_all();
+        if (!batch)
+            continue;
+        uint64_t start = now_ns();
+
+        uint32_t first_segment = log_segments.size() - 1;
+        size_t first_offset = log_segments.back().used;
+        locations.clear();
+        LogLocation location;
+        for (LogRecord *record = batch; record && !log_disabled.load() && write_record(*record, location);
+             record = record->next)
+            locations.push_back(location);
+        for (uint32_t i = first_segment; i < log_segments.size(); i++)
+        {
+            size_t from = i == first_segment ? first_offset & ~(page_size - 1) : 0;
+            msync(log_segments[i].data + from, log_segments[i].used - from, MS_SYNC);
+        }
+
+        ThreadMetrics &metrics = local_metrics();
+        metrics.log_records.add(locations.size());
+        metrics.log_batch_records.record(locations.size());
+        metrics.log_commit_ns.record(now_ns() - start);
+
+        // The recipient is looked up under the lock, so a login either sees the record
+        // in the index or is found here; the mail itself is posted after unlocking.
+        unique_lock<shared_mutex> lock(log_index_mutex);
+        size_t i = 0;
+        deliveries.clear();
+        while (batch)
+        {
+            LogRecord *record = batch;
+            batch = batch->next;
+            ClientInfo target;
+            if (i >= locations.size())
+            {
+                metrics.log_dropped.add();
+                delete record;
+            }
+            else if (record->kind == LogKind::Offline && clients.find(record->key, target))
+            {
+                deliveries.push_back(OfflineDelivery{target, record, locations[i].seq});
+            }
+            else
+            {
+                index_record(record->kind, record->key, *record->text, locations[i]);
+                delete record;
+            }
+            i++;
+        }
+        lock.unlock();
+        for (OfflineDelivery &delivery : deliveries)
+        {
+            send_to_client(delivery.target, delivery.record->text);
+            log_append(LogKind::Delivered, delivery.record->key, make_payload(to_string(delivery.seq)));
+            delete delivery.record;
+        }
+        log_pending.fetch_sub(i);
+    }
+}
+
+// Sends a client who just joined a group the group's latest logged messages.
+void replay_group_history(Connection &conn, const ChatGroup *group)
+{
+    shared_lock<shared_mutex> lock(log_index_mutex);
+    auto it = group_history.find(group->name);
+    if (it == group_history.end())
+        return;
+    string count = to_string(it->second.size());
+    send_reply(conn, "Last ", count, " message(s) in group \"", group->name, "\":\n");
+    for (const LogLocation &location : it->second)
+        send_reply(conn, log_text(location));
+}
+
+// Delivers the private messages logged while a user was offline, and logs that they
+// were delivered.
+void deliver_offline_messages(Connection &conn)
+{
+    unique_lock<shared_mutex> lock(log_index_mutex);
+    auto it = offline_messages.find(conn.username);
+    if (it == offline_messages.end())
+        return;
+    string count = to_string(it->second.size());
+    send_reply(conn, "You have ", count, " message(s) sent while you were offline:\n");
+    for (const LogLocation &location : it->second)
+        send_reply(conn, log_text(location));
+    uint64_t last = it->second.back().seq;
+    offline_messages.erase(it);
+    lock.unlock();
+    log_append(LogKind::Delivered, conn.username, make_payload(to_string(last)));
+}
+
+// --- Cluster ---
+// Several server processes ("nodes") can form a cluster, each serving its own clients.
+// Every node dials each of its peers and sends its updates over that link; it receives
+// the peers' updates on the links they dial to it. Updates cover presence (who is
+// logged in where), which groups exist and which nodes have members in them, and the
+// messages themselves, already formatted for clients. All link I/O runs on a cluster
+// thread of its own; shards hand it outgoing updates through a lock-free mailbox, and
+// it writes everything queued for a link in one syscall.
+
+// A peer link carries frames of [4-byte big-endian length][op][2-byte key length][key]
+// [body], where the length counts everything after itself.
+enum class PeerOp : uint8_t
+{
+    Hello = 1,     // key: the sending node's id; sent first on every link.
+    UserOnline,    // key: a user who logged in on the sending node.
+    UserOffline,   // key: a user who logged out.
+    GroupCreated,  // key: a group name.
+    GroupInterest, // key: a group that now has members on the sending node.
+    GroupIdle,     // key: a group whose last member on the sending node left.
+    Direct,        // key: the recipient; body: the message.
+    Broadcast,     // body: the message.
+    GroupMsg,      // key: the group; body: the message.
+    GroupChanged   // Queued by shards only; sent as GroupInterest or GroupIdle.
+};
+
+// An update queued for the cluster thread, to be sent to every node in 'nodes'.
+struct PeerItem
+{
+    PeerOp op;
+    string key;
+    Payload payload;
+    uint64_t nodes;
+    PeerItem *next = nullptr;
+};
+
+int node_id = -1;             // This node's id; -1 when not part of a cluster.
+int cluster_port = 0;         // Port on which peers connect to this node.
+Mailbox<PeerItem> cluster_queue;
+int cluster_wake_fd = -1;
+atomic<bool> cluster_park{false}; // Set by a handover; see park_cluster().
+StringMap<int> remote_users;  // Users logged in on other nodes -> their node.
+shared_mutex remote_users_mutex;
+
+// Queues an update for the peer nodes selected by 'nodes'. Does nothing outside a cluster.
+void cluster_publish(PeerOp op, string_view key, const Payload &payload = nullptr, uint64_t nodes = ~0ull)
+{
+    if (node_id < 0)
+        return;
+    PeerItem *item = new PeerItem{op, string(key), payload, nodes};
+    if (cluster_queue.push(item))
+    {
+        uint64_t one = 1;
+        ssize_t ignored = write(cluster_wake_fd, &one, sizeof(one));
+        (void)ignored;
+    }
+}
+
+// Looks up a user logged in on another node. Returns false if there is none.
+bool find_remote_user(string_view username, int &node)
+{
+    if (node_id < 0)
+        return false;
+    shared_lock<shared_mutex> lock(remote_users_mutex);
+    auto it = remote_users.find(username);
+    if (it == remote_users.end())
+        return false;
+    node = it->second;
+    return true;
+}
+
+// Sends a message to every active client on this node's shards except the given session.
+void broadcast_local(uint64_t sender_session, const Payload &message, const Payload &binary = nullptr)
+{
+    for (auto &dest : shards)
+    {
+        Mail *mail = new Mail(Mail::Broadcast);
+        mail->session = sender_session;
+        mail->payload = message;
+        mail->binary = binary;
+        post_mail(dest->id, mail);
+    }
+}
+
+// Sends a message to every active client in the cluster except the given session.
+// The message is formatted once into a shared buffer that every recipient queues, plus
+// once as a binary frame ('binary', from make_frame) for binary clients on this node.
+void broadcast_message(uint64_t sender_session, const Payload &message, const Payload &binary = nullptr)
+{
+    broadcast_local(sender_session, message, binary);
+    cluster_publish(PeerOp::Broadcast, "", message);
+}
+
+// Delivers a formatted group message to the group's members on this node except the
+// given session. Only shards that own members of the group are mailed.
+void deliver_to_group(ChatGroup *group, uint64_t sender_session, const Payload &message, const Payload &binary = nullptr)
+{
+    for (auto &dest : shards)
+    {
+        if (group->shards[dest->id].count.load(memory_order_relaxed) == 0)
+            continue;
+        Mail *mail = new Mail(Mail::Group);
+        mail->session = sender_session;
+        mail->group = group;
+        mail->payload = message;
+        mail->binary = binary;
+        post_mail(dest->id, mail);
+    }
+}
+
+// Sends a formatted group message to all members of a group except the sender, here
+// and on the other nodes that have members. Assumes that group existence and
+// membership have already been validated.
+void group_message(const Connection &sender, ChatGroup *group, string_view message)
+{
+    Payload full_message = make_payload("[Group ", group->name, "]: ", message, "\n");
+    local_metrics().fanout_recipients.record(group->local_members.load(memory_order_relaxed) - 1);
+    log_append(LogKind::Group, group->name, full_message);
+    deliver_to_group(group, sender.session, full_message, make_frame(FrameType::Group, group->name_id, message));
+    uint64_t nodes = group->remote_nodes.load(memory_order_relaxed);
+    if (nodes)
+        cluster_publish(PeerOp::GroupMsg, group->name, full_message, nodes);
+}
+
+// Returns the group with the given name, or nullptr if it does not exist.
+ChatGroup *find_group(string_view group_name)
+{
+    return groups.find(group_name);
+}
+
+// Returns the group with the given name, creating it if it does not exist yet.
+// 'created' tells which of the two happened.
+ChatGroup *get_or_create_group(string_view group_name, bool &created)
+{
+    created = false;
+    if (ChatGroup *group = groups.find(group_name))
+        return group;
+    auto group = make_unique<ChatGroup>();
+    group->name = group_name;
+    group->shards = make_unique<GroupShard[]>(shards.size());
+    group->name_id = intern_name(group_name);
+    return groups.insert(std::move(group), created);
+}
+
+// Adds a connection to the calling shard's members of a group.
+void join_group(Connection &conn, ChatGroup *group)
+{
+    GroupShard &local = group->shards[shard->id];
+    conn.joined_groups[group] = local.members.size();
+    local.members.push_back(&conn);
+    local.count.store(local.members.size(), memory_order_relaxed);
+    if (group->local_members.fetch_add(1, memory_order_relaxed) == 0)
+        cluster_publish(PeerOp::GroupChanged, group->name);
+}
+
+// Removes a connection from a group in O(1) by moving the shard's last member into
+// its slot. Assumes the connection is a member.
+void leave_group(Connection &conn, ChatGroup *group)
+{
+    GroupShard &local = group->shards[shard->id];
+    size_t slot = conn.joined_groups[group];
+    Connection *last = local.members.back();
+    local.members[slot] = last;
+    last->joined_groups[group] = slot;
+    local.members.pop_back();
+    local.count.store(local.members.size(), memory_order_relaxed);
+    conn.joined_groups.erase(group);
+    if (group->local_members.fetch_sub(1, memory_order_relaxed) == 1)
+        cluster_publish(PeerOp::GroupChanged, group->name);
+}
+
+// --- Connection Timers ---
+// Each connection has one timer in its shard's wheel. Until login it holds the login
+// deadline; afterwards it fires at the next idle or heartbeat deadline. Input only
+// updates timestamps, so receiving data never touches the wheel: a timer that fires
+// early finds the deadline has moved and reschedules itself.
+
+// Records that a client sent something, which answers any outstanding ping.
+void note_input(Connection &conn)
+{
+    conn.last_input = now_ns();
+    conn.ping_sent_at = 0;
+}
+
+// Schedules an active connection's timer for its earliest deadline: the idle timeout,
+// the next ping, or the end of the wait for a ping's answer.
+void schedule_checks(Connection &conn, uint64_t now)
+{
+    uint64_t due = UINT64_MAX;
+    if (idle_timeout_ms)
+        due = conn.last_command + idle_timeout_ms * 1000000;
+    if (ping_interval_ms)
+        due = min(due, (conn.ping_sent_at ? conn.ping_sent_at : conn.last_input) + ping_interval_ms * 1000000);
+    if (due != UINT64_MAX)
+        shard->timers.schedule(conn.timer, due > now ? (due - now) / 1000000 : 0);
+}
+
+// --- Cluster Links ---
+// The cluster thread owns every peer link. Outgoing links (one per --peer) are dialled
+// at startup and redialled after a failure; each (re)connection starts with a snapshot
+// of this node's state, so a peer that restarted or lost the link catches up. State
+// learned from a peer is dropped when its incoming link closes.
+
+// One TCP link to a peer node: dialled by this node (outgoing, used for sending) or
+// by the peer (incoming, used for receiving).
+struct PeerLink
+{
+    int node = -1;          // The peer's node id; learned from Hello on incoming links.
+    bool outgoing = false;
+    sockaddr_in addr{};     // Where an outgoing link connects.
+    int fd = -1;
+    bool connected = false; // Outgoing links are written only once connected.
+    string inbuf;
+    string outbuf;          // Frames queued since the last write.
+    uint64_t retry_at = 0;  // now_ns() after which a closed outgoing link is redialled.
+};
+
+vector<unique_ptr<PeerLink>> peer_links; // Outgoing links, one per --peer.
+int cluster_epoll_fd = -1;
+int cluster_listen_fd = -1;
+unordered_map<int, PeerLink *> links_by_fd;
+unordered_map<int, unique_ptr<PeerLink>> incoming_links;
+PeerLink *incoming_by_node[MAX_NODES]; // The current incoming link of each node.
+
+// Appends one frame to a link's output.
+void append_frame(string &out, PeerOp op, string_view key, string_view body)
+{
+    uint32_t length = 3 + key.size() + body.size();
+    char header[7] = {char(length >> 24), char(length >> 16), char(length >> 8), char(length),
+                      char(op), char(key.size() >> 8), char(key.size())};
+    out.append(header, sizeof(header));
+    out.append(key);
+    out.append(body);
+    local_metrics().peer_frames_sent.add();
+}
+
+// Queues a Hello and the current state of this node for a newly dialled peer.
+void append_snapshot(string &out)
+{
+    append_frame(out, PeerOp::Hello, to_string(node_id), "");
+    groups.for_each([&out](ChatGroup &group)
+                    {
+        append_frame(out, PeerOp::GroupCreated, group.name, "");
+        if (group.local_members.load(memory_order_relaxed) > 0)
+            append_frame(out, PeerOp::GroupInterest, group.name, ""); });
+    clients.for_each([&out](const string &username)
+                     { append_frame(out, PeerOp::UserOnline, username, ""); });
+}
+
+// Forgets everything learned from a node: its users and its group memberships.
+void forget_node(int node)
+{
+    {
+        unique_lock<shared_mutex> lock(remote_users_mutex);
+        for (auto it = remote_users.begin(); it != remote_users.end();)
+            it = it->second == node ? remote_users.erase(it) : next(it);
+    }
+    groups.for_each([node](ChatGroup &group)
+                    { group.remote_nodes.fetch_and(~(1ull << node), memory_order_relaxed); });
+}
+
+// Closes a link. An outgoing link is redialled after PEER_RETRY_MS; the state learned
+// over an incoming link is forgotten unless the peer has already replaced the link.
+void close_link(PeerLink &link)
+{
+    int fd = link.fd;
+    epoll_ctl(cluster_epoll_fd, EPOLL_CTL_DEL, fd, nullptr);
+    links_by_fd.erase(fd);
+    close(fd);
+    link.fd = -1;
+    if (link.outgoing)
+    {
+        if (link.connected)
+            cerr << "Lost the link to node " << link.node << ".\n";
+        link.connected = false;
+        link.inbuf.clear();
+        link.outbuf.clear();
+        link.retry_at = now_ns() + PEER_RETRY_MS * 1000000ull;
+        return;
+    }
+    if (link.node >= 0 && incoming_by_node[link.node] == &link)
+    {
+        incoming_by_node[link.node] = nullptr;
+        forget_node(link.node);
+    }
+    incoming_links.erase(fd); // Destroys 'link'.
+}
+
+// Watches a link's socket on the cluster thread's epoll instance.
+bool watch_link(PeerLink &link)
+{
+    epoll_event ev{};
+    ev.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+    ev.data.fd = link.fd;
+    if (epoll_ctl(cluster_epoll_fd, EPOLL_CTL_ADD, link.fd, &ev) < 0)
+    {
+        close(link.fd);
+        link.fd = -1;
+        return false;
+    }
+    links_by_fd[link.fd] = &link;
+    return true;
+}
+
+// Starts dialling a peer. The snapshot is queued at once and sent when the connection
+// completes, so updates queued meanwhile follow it in order.
+void dial_peer(PeerLink &link)
+{
+    link.retry_at = now_ns() + PEER_RETRY_MS * 1000000ull;
+    link.fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (link.fd < 0)
+        return;
+    int one = 1;
+    setsockopt(link.fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    if (connect(link.fd, (sockaddr *)&link.addr, sizeof(link.addr)) < 0 && errno != EINPROGRESS)
+    {
+        close(link.fd);
+        link.fd = -1;
+        return;
+    }
+    if (!watch_link(link))
+        return;
+    append_snapshot(link.outbuf);
+}
+
+// Writes a link's queued frames, all of them in one syscall when the socket takes them.
+// Returns false if the link failed.
+bool flush_link(PeerLink &link)
+{
+    size_t sent = 0;
+    while (sent < link.outbuf.size())
+    {
+        ssize_t n = send(link.fd, link.outbuf.data() + sent, link.outbuf.size() - sent, MSG_NOSIGNAL);
+        local_metrics().peer_writes.add();
+        if (n < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                break;
+            return false;
+        }
+        sent += n;
+    }
+    link.outbuf.erase(0, sent);
+    return true;
+}
+
+// Applies one frame received from a peer.
+void handle_peer_frame(PeerLink &link, PeerOp op, string_view key, string_view body)
+{
+    local_metrics().peer_frames_received.add();
+    if (op == PeerOp::Hello)
+    {
+        int node = -1;
+        from_chars(key.data(), key.data() + key.size(), node);
+        if (node < 0 || node >= MAX_NODES || node == node_id)
+            return;
+        // A reconnecting peer resends its whole state, so anything learned over its
+        // previous link is dropped first.
+        forget_node(node);
+        link.node = node;
+        incoming_by_node[node] = &link;
+        return;
+    }
+    if (link.node < 0)
+        return; // Nothing is accepted before Hello.
+    bool created;
+    switch (op)
+    {
+    case PeerOp::UserOnline:
+    {
+        unique_lock<shared_mutex> lock(remote_users_mutex);
+        remote_users[string(key)] = link.node;
+        break;
+    }
+    case PeerOp::UserOffline:
+    {
+        unique_lock<shared_mutex> lock(remote_users_mutex);
+        auto it = remote_users.find(key);
+        if (it != remote_users.end() && it->second == link.node)
+            remote_users.erase(it);
+        break;
+    }
+    case PeerOp::GroupCreated:
+        get_or_create_group(key, created);
+        break;
+    case PeerOp::GroupInterest:
+        get_or_create_group(key, created)->remote_nodes.fetch_or(1ull << link.node, memory_order_relaxed);
+        break;
+    case PeerOp::GroupIdle:
+        get_or_create_group(key, created)->remote_nodes.fetch_and(~(1ull << link.node), memory_order_relaxed);
+        break;
+    case PeerOp::Direct:
+    {
+        ClientInfo target;
+        if (clients.find(key, target))
+            send_to_client(target, make_payload(body));
+        break;
+    }
+    case PeerOp::Broadcast:
+        broadcast_local(0, make_payload(body));
+        break;
+    case PeerOp::GroupMsg:
+        if (ChatGroup *group = find_group(key))
+        {
+            Payload message = make_payload(body);
+            log_append(LogKind::Group, group->name, message);
+            deliver_to_group(group, 0, message);
+        }
+        break;
+    default:
+        break;
+    }
+}
+
+// Applies each complete frame at the front of a link's input and drops it. Returns
+// false if a frame is malformed or longer than MAX_PEER_FRAME.
+bool parse_link(PeerLink &link)
+{
+    size_t pos = 0;
+    while (link.inbuf.size() - pos >= 4)
+    {
+        const unsigned char *header = (const unsigned char *)link.inbuf.data() + pos;
+        uint32_t length = (uint32_t(header[0]) << 24) | (uint32_t(header[1]) << 16) |
+                          (uint32_t(header[2]) << 8) | uint32_t(header[3]);
+        if (length < 3 || length > MAX_PEER_FRAME)
+            return false;
+        if (link.inbuf.size() - pos - 4 < length)
+            break;
+        size_t key_length = (size_t(header[5]) << 8) | header[6];
+        if (key_length > length - 3)
+            return false;
+        string_view frame = string_view(link.inbuf).substr(pos + 7, length - 3);
+        handle_peer_frame(link, PeerOp(header[4]), frame.substr(0, key_length), frame.substr(key_length));
+        pos += 4 + length;
+    }
+    link.inbuf.erase(0, pos);
+    return true;
+}
+
+// Reads everything available on a link, applying the complete frames after each recv
+// so the input never holds more than one partial frame and one buffer. Returns false
+// if the link was closed or sent a malformed frame.
+bool read_link(PeerLink &link)
+{
+    char buffer[BUFFER_SIZE * 4];
+    while (true)
+    {
+        ssize_t n = recv(link.fd, buffer, sizeof(buffer), 0);
+        if (n == 0)
+            return false;
+        if (n < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            return errno == EAGAIN || errno == EWOULDBLOCK;
+        }
+        if (link.outgoing)
+            continue; // Peers never send on the links this node dialled.
+        link.inbuf.append(buffer, n);
+        if (!parse_link(link))
+            return false;
+    }
+}
+
+// Moves every update queued by the shards into the output of the links it is meant for.
+void drain_cluster_queue()
+{
+    uint64_t count;
+    while (read(cluster_wake_fd, &count, sizeof(count)) > 0)
+        ;
+    PeerItem *item = cluster_queue.take_all();
+    while (item)
+    {
+        PeerOp op = item->op;
+        if (op == PeerOp::GroupChanged)
+        {
+            // Joins and leaves on different shards may be queued out of order, so the
+            // current member count decides what is announced.
+            ChatGroup *group = find_group(item->key);
+            op = group && group->local_members.load(memory_order_relaxed) > 0 ? PeerOp::GroupInterest : PeerOp::GroupIdle;
+        }
+        string_view body = item->payload ? string_view(*item->payload) : string_view();
+        for (auto &link : peer_links)
+        {
+            if (link->fd >= 0 && (item->nodes >> link->node & 1))
+                append_frame(link->outbuf, op, item->key, body);
+        }
+        PeerItem *next = item->next;
+        delete item;
+        item = next;
+    }
+}
+
+// Stops the cluster thread for the duration of a handover; defined below.
+void park_cluster();
+
+// Cluster thread: accepts incoming links, dials peers, applies the frames peers send,
+// and writes the frames the shards queue, batched per link once per round.
+void run_cluster()
+{
+    epoll_event events[MAX_EVENTS];
+    while (true)
+    {
+        int n = epoll_wait(cluster_epoll_fd, events, MAX_EVENTS, PEER_RETRY_MS);
+        for (int i = 0; i < n; i++)
+        {
+            int fd = events[i].data.fd;
+            if (fd == cluster_wake_fd)
+            {
+                drain_cluster_queue();
+                continue;
+            }
+            if (fd == cluster_listen_fd)
+            {
+                int link_fd;
+                while ((link_fd = accept4(cluster_listen_fd, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC)) >= 0)
+                {
+                    auto link = make_unique<PeerLink>();
+                    link->fd = link_fd;
+                    if (watch_link(*link))
+                    {
+                        PeerLink &ref = *link;
+                        incoming_links[link_fd] = std::move(link);
+                        if (!read_link(ref))
+                            close_link(ref);
+                    }
+                }
+                continue;
+            }
+            auto it = links_by_fd.find(fd);
+            if (it == links_by_fd.end())
+                continue;
+            PeerLink &link = *it->second;
+            bool alive = !(events[i].events & EPOLLERR);
+            if (alive && link.outgoing && !link.connected && (events[i].events & EPOLLOUT))
+            {
+                link.connected = true;
+                cout << "Linked to node " << link.node << "." << endl;
+            }
+            if (alive && (events[i].events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP)))
+                alive = read_link(link);
+            if (!alive)
+                close_link(link);
+        }
+
+        // Write everything queued this round, one batch per link, and redial the
+        // peers whose links are down.
+        drain_cluster_queue();
+        uint64_t now = now_ns();
+        for (auto &link : peer_links)
+        {
+            if (link->fd < 0 && now >= link->retry_at)
+                dial_peer(*link);
+            else if (link->connected && !link->outbuf.empty() &&
+                     (!flush_link(*link) || link->outbuf.size() > PEER_QUEUE_LIMIT))
+                close_link(*link);
+        }
+        if (cluster_park.load())
+            park_cluster();
+    }
+}
+
+// Parses a "--peer ID@HOST:PORT" argument into an outgoing link. Returns false if it is
+// malformed.
+bool add_peer(const string &spec)
+{
+    size_t at = spec.find('@');
+    size_t colon = spec.rfind(':');
+    if (at == string::npos || colon == string::npos || colon < at)
+        return false;
+    auto link = make_unique<PeerLink>();
+    link->outgoing = true;
+    link->node = atoi(spec.substr(0, at).c_str());
+    string host = spec.substr(at + 1, colon - at - 1);
+    addrinfo hints{};
+    hints.ai_family = AF_INET;
+    hints.ai_socktype = SOCK_STREAM;
+    addrinfo *result = nullptr;
+    if (link->node < 0 || link->node >= MAX_NODES ||
+        getaddrinfo(host.c_str(), spec.c_str() + colon + 1, &hints, &result) != 0)
+        return false;
+    link->addr = *(sockaddr_in *)result->ai_addr;
+    freeaddrinfo(result);
+    peer_links.push_back(std::move(link));
+    return true;
+}
+
+// Opens the cluster port, unless a previous server process handed its socket over,
+// and starts the cluster thread. Returns false on failure.
+bool start_cluster()
+{
+    bool adopted = cluster_listen_fd >= 0;
+    if (!adopted)
+        cluster_listen_fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    cluster_epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    cluster_wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (cluster_listen_fd < 0 || cluster_epoll_fd < 0 || cluster_wake_fd < 0)
+    {
+        cerr << "Error: Unable to set up the cluster link.\n";
+        return false;
+    }
+    int one = 1;
+    setsockopt(cluster_listen_fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    sockaddr_in addr{};
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(cluster_port);
+    addr.sin_addr.s_addr = INADDR_ANY;
+    if (!adopted && (::bind(cluster_listen_fd, (sockaddr *)&addr, sizeof(addr)) < 0 || listen(cluster_listen_fd, SOMAXCONN) < 0))
+    {
+        cerr << "Error: Unable to listen on cluster port " << cluster_port << ".\n";
+        return false;
+    }
+    epoll_event ev{};
+    ev.events = EPOLLIN | EPOLLET;
+    ev.data.fd = cluster_listen_fd;
+    epoll_ctl(cluster_epoll_fd, EPOLL_CTL_ADD, cluster_listen_fd, &ev);
+    ev.data.fd = cluster_wake_fd;
+    epoll_ctl(cluster_epoll_fd, EPOLL_CTL_ADD, cluster_wake_fd, &ev);
+    thread(run_cluster).detach();
+    return true;
+}
+
+// --- Authentication Workers ---
+// Checking a salted hash takes milliseconds of CPU by design, so passwords are checked
+// on a small pool of worker threads instead of the shards. The queue in front of the
+// pool is bounded: during a login storm, logins beyond AUTH_QUEUE_LIMIT are turned away
+// at once rather than queueing without limit.
+
+// A login waiting to be verified. The result is posted back to 'shard_id' as mail.
+struct AuthRequest
+{
+    int shard_id;
+    int fd;
+    uint64_t session;
+    string username;
+    string password;
+    uint64_t queued_at;
+};
+
+deque<AuthRequest> auth_queue;
+mutex auth_mutex;
+condition_variable auth_ready;
+
+// Queues a login for verification. Returns false if the queue is full.
+bool submit_auth(AuthRequest request)
+{
+    {
+        lock_guard<mutex> lock(auth_mutex);
+        if (auth_queue.size() >= AUTH_QUEUE_LIMIT)
+            return false;
+        auth_queue.push_back(std::move(request));
+    }
+    auth_ready.notify_one();
+    return true;
+}
+
+// Verifies queued logins until the server exits. Runs on each authentication worker.
+void run_auth_worker()
+{
+    while (true)
+    {
+        AuthRequest request;
+        {
+            unique_lock<mutex> lock(auth_mutex);
+            while (auth_queue.empty())
+                auth_ready.wait(lock);
+            request = std::move(auth_queue.front());
+            auth_queue.pop_front();
+        }
+        ThreadMetrics &metrics = local_metrics();
+        metrics.auth_wait_ns.record(now_ns() - request.queued_at);
+
+        // Copy the credential so a concurrent reload cannot free it mid-check.
+        Credential credential;
+        bool known;
+        {
+            shared_lock<shared_mutex> lock(users_mutex);
+            auto user = users.find(request.username);
+            known = user != users.end();
+            if (known)
+                credential = user->second;
+        }
+        uint64_t start = now_ns();
+        bool verified = known && verify_password(credential, request.password);
+        metrics.auth_verify_ns.record(now_ns() - start);
+
+        Mail *mail = new Mail(Mail::AuthResult);
+        mail->fd = request.fd;
+        mail->session = request.session;
+        mail->verified = verified;
+        post_mail(request.shard_id, mail);
+    }
+}
+
+// Handles the username and password exchange for a connection that is not yet active.
+// The password is handed to the authentication workers; the connection reads no further
+// commands until finish_auth() has the result.
+void handle_auth(Connection &conn, string_view input)
+{
+    if (conn.state == ConnState::AwaitUsername)
+    {
+        conn.username = input;
+        conn.state = ConnState::AwaitPassword;
+        send_reply(conn, "Enter password: ");
+        return;
+    }
+
+    AuthRequest request{shard->id, conn.fd, conn.session, conn.username, string(input), now_ns()};
+    if (!submit_auth(std::move(request)))
+    {
+        local_metrics().auth_rejected.add();
+        send_reply(conn, "Error: Server busy, try again later.\n");
+        conn.close_after_flush = true;
+        return;
+    }
+    conn.state = ConnState::Authenticating;
+}
+
+// Completes a login with the verdict of the authentication workers. Reading was paused
+// while the password was checked; it resumes, starting with any commands the client
+// sent meanwhile, when the reply is flushed.
+void finish_auth(Connection &conn, bool verified)
+{
+    const string &username = conn.username;
+    conn.state = ConnState::AwaitPassword;
+    if (!verified)
+    {
+        local_metrics().auth_failures.add();
+        send_reply(conn, "Error: Authentication failed.\n");
+        conn.close_after_flush = true;
+        return;
+    }
+
+    // Add the new client to the active client list, which also prevents duplicate
+    // connections using the same username (on this node or, in a cluster, another one).
+    int node;
+    if (find_remote_user(username, node) || !clients.insert(username, ClientInfo{shard->id, conn.fd, conn.session}))
+    {
+        send_reply(conn, "Error: User \"", username, "\" is already connected.\n");
+        conn.close_after_flush = true;
+        return;
+    }
+    cluster_publish(PeerOp::UserOnline, username);
+    // Inform other connected clients of the new connection.
+    broadcast_message(conn.session, make_payload(username, " has joined the chat.\n"));
+
+    conn.state = ConnState::Active;
+    conn.name_id = intern_name(username);
+    conn.last_input = conn.last_command = now_ns();
+    schedule_checks(conn, conn.last_input);
+    active_clients.fetch_add(1, memory_order_relaxed);
+    ThreadMetrics &metrics = local_metrics();
+    metrics.logins.add();
+    metrics.auth_time_ns.record(now_ns() - conn.accepted_at);
+    cout << username << " connected." << endl;
+    send_reply(conn, "Welcome to the chat server!\n");
+    deliver_offline_messages(conn);
+}
+
+// --- Command Handlers ---
+// Each handler receives the text after the command word and its separating space.
+// 'has_args' is false when the command word was not followed by a space at all.
+
+// Takes a sender's tokens for a message about to fan out. If the user's bucket is
+// empty, replies with how long to wait and returns false.
+bool admit_user_message(Connection &conn, uint64_t cost)
+{
+    uint64_t wait_ns;
+    if (take_tokens(conn.rate_full_at, user_limit, cost, now_ns(), wait_ns))
+        return true;
+    local_metrics().user_throttled.add();
+    send_reply(conn, "Error: You are sending too fast; try again in ", to_string(wait_ns / 1000000 + 1), " ms.\n");
+    return false;
+}
+
+// Sends a private message; the body of /msg and of binary Direct frames.
+void private_message(Connection &conn, string_view target_user, string_view private_msg)
+{
+    if (private_msg.empty())
+    {
+        send_reply(conn, "Error: Private message content is empty.\n");
+        return;
+    }
+    if (!admit_user_message(conn, 1))
+        return;
+    ClientInfo target;
+    if (clients.find(target_user, target))
+    {
+        if (target.session == conn.session)
+            send_reply(conn, "Error: Cannot send a private message to yourself.\n");
+        else
+        {
+            local_metrics().fanout_recipients.record(1);
+            Payload message = make_payload("[", conn.username, "]: ", private_msg, "\n");
+            send_to_client(target, message, make_frame(FrameType::Direct, conn.name_id, private_msg));
+            log_append(LogKind::Private, target_user, message);
+        }
+    }
+    // Users logged in on another node of the cluster are reached through that node.
+    else if (int node; find_remote_user(target_user, node))
+    {
+        local_metrics().fanout_recipients.record(1);
+        Payload message = make_payload("[", conn.username, "]: ", private_msg, "\n");
+        cluster_publish(PeerOp::Direct, target_user, message, 1ull << node);
+        log_append(LogKind::Private, target_user, message);
+    }
+    // With the message log enabled, messages to registered users who are offline are
+    // kept for their next login.
+    else if (!log_dir.empty() && !log_disabled.load(memory_order_relaxed) && user_exists(target_user))
+    {
+        log_append(LogKind::Offline, target_user, make_payload("[", conn.username, "]: ", private_msg, "\n"));
+        send_reply(conn, "User \"", target_user, "\" is offline; the message will be delivered when they log in.\n");
+    }
+    else
+    {
+        send_reply(conn, "Error: User \"", target_user, "\" not found.\n");
+    }
+}
+
+// Command: /msg <username> <message>
+void command_msg(Connection &conn, string_view args, bool has_args)
+{
+    size_t space1 = has_args ? args.find(' ') : string_view::npos;
+    if (space1 == string_view::npos)
+    {
+        send_reply(conn, "Error: Incorrect format. Use: /msg <username> <message>\n");
+        return;
+    }
+    private_message(conn, args.substr(0, space1), args.substr(space1 + 1));
+}
+
+// Sends a message to everyone; the body of /broadcast and of binary Broadcast frames.
+void broadcast_text(Connection &conn, string_view text)
+{
+    if (text.empty())
+    {
+        send_reply(conn, "Error: Broadcast message content is empty.\n");
+        return;
+    }
+    if (!admit_user_message(conn, BROADCAST_COST))
+        return;
+    local_metrics().fanout_recipients.record(active_clients.load(memory_order_relaxed) - 1);
+    broadcast_message(conn.session, make_payload("[", conn.username, "] (Broadcast): ", text, "\n"),
+                      make_frame(FrameType::Broadcast, conn.name_id, text));
+}
+
+// Command: /broadcast <message>
+void command_broadcast(Connection &conn, string_view args, bool has_args)
+{
+    if (!has_args)
+    {
+        send_reply(conn, "Error: Incorrect format. Use: /broadcast <message>\n");
+        return;
+    }
+    broadcast_text(conn, args);
+}
+
+// Command: /create_group <group name>
+void command_create_group(Connection &conn, string_view group_name, bool has_args)
+{
+    if (!has_args)
+    {
+        send_reply(conn, "Error: Incorrect format. Use: /create_group <group name>\n");
+        return;
+    }
+    if (group_name.empty())
+    {
+        send_reply(conn, "Error: Group name cannot be empty.\n");
+        return;
+    }
+    // Check that group names do not contain spaces.
+    if (contains_space(group_name))
+    {
+        send_reply(conn, "Error: Group name must not contain spaces.\n");
+        return;
+    }
+    bool created;
+    ChatGroup *group = get_or_create_group(group_name, created);
+    if (created)
+    {
+        cluster_publish(PeerOp::GroupCreated, group_name);
+        join_group(conn, group);
+        announce_name(conn, group->name_id);
+        send_reply(conn, "Group \"", group_name, "\" created successfully.\n");
+    }
+    else
+    {
+        send_reply(conn, "Error: Group \"", group_name, "\" already exists.\n");
+    }
+}
+
+// Command: /join_group <group name>
+void command_join_group(Connection &conn, string_view group_name, bool has_args)
+{
+    if (!has_args)
+    {
+        send_reply(conn, "Error: Incorrect format. Use: /join_group <group name>\n");
+        return;
+    }
+    if (group_name.empty())
+    {
+        send_reply(conn, "Error: Group name cannot be empty.\n");
+        return;
+    }
+    ChatGroup *group = find_group(group_name);
+    if (!group)
+    {
+        send_reply(conn, "Error: Group \"", group_name, "\" does not exist.\n");
+    }
+    // Prevent joining the same group more than once.
+    else if (conn.joined_groups.count(group))
+    {
+        send_reply(conn, "Error: Already a member of group \"", group_name, "\".\n");
+    }
+    else
+    {
+        join_group(conn, group);
+        announce_name(conn, group->name_id);
+        send_reply(conn, "Joined group \"", group_name, "\" successfully.\n");
+        replay_group_history(conn, group);
+    }
+}
+
+// Sends a message to a group; the body of /group_msg and of binary Group frames.
+void group_text(Connection &conn, string_view group_name, string_view group_msg)
+{
+    if (group_msg.empty())
+    {
+        send_reply(conn, "Error: Group message content is empty.\n");
+        return;
+    }
+    ChatGroup *group = find_group(group_name);
+    if (!group)
+    {
+        send_reply(conn, "Error: Group \"", group_name, "\" does not exist.\n");
+        return;
+    }
+    // Verify that the sender is a member of the group.
+    if (!conn.joined_groups.count(group))
+    {
+        send_reply(conn, "Error: Not a member of group \"", group_name, "\".\n");
+        return;
+    }
+    // The group's bucket is only tried once the user's allows the message; if the group
+    // refuses it, the user's token is handed back.
+    if (!admit_user_message(conn, 1))
+        return;
+    uint64_t wait_ns;
+    if (!take_tokens(group->rate_full_at, group_limit, 1, now_ns(), wait_ns))
+    {
+        if (user_limit.interval_ns)
+            conn.rate_full_at -= user_limit.interval_ns;
+        local_metrics().group_throttled.add();
+        send_reply(conn, "Error: Group \"", group_name, "\" is busy; try again in ", to_string(wait_ns / 1000000 + 1), " ms.\n");
+        return;
+    }
+    group_message(conn, group, group_msg);
+}
+
+// Command: /group_msg <group name> <message>
+void command_group_msg(Connection &conn, string_view args, bool has_args)
+{
+    size_t space1 = has_args ? args.find(' ') : string_view::npos;
+    if (space1 == string_view::npos)
+    {
+        send_reply(conn, "Error: Incorrect format. Use: /group_msg <group name> <message>\n");
+        return;
+    }
+    group_text(conn, args.substr(0, space1), args.substr(space1 + 1));
+}
+
+// Command: /leave_group <group name>
+void command_leave_group(Connection &conn, string_view group_name, bool has_args)
+{
+    if (!has_args)
+    {
+        send_reply(conn, "Error: Incorrect format. Use: /leave_group <group name>\n");
+        return;
+    }
+    if (group_name.empty())
+    {
+        send_reply(conn, "Error: Group name cannot be empty.\n");
+        return;
+    }
+    ChatGroup *group = find_group(group_name);
+    if (!group)
+    {
+        send_reply(conn, "Error: Group \"", group_name, "\" does not exist.\n");
+    }
+    else if (conn.joined_groups.count(group))
+    {
+        leave_group(conn, group);
+        send_reply(conn, "Left group \"", group_name, "\" successfully.\n");
+    }
+    else
+    {
+        send_reply(conn, "Error: Not a member of group \"", group_name, "\".\n");
+    }
+}
+
+// Command: /pong
+// A client's answer to "/ping". Any input shows that the client is alive, so there is
+// nothing left to do here.
+void command_pong(Connection &, string_view, bool)
+{
+}
+
+using CommandHandler = void (*)(Connection &conn, string_view args, bool has_args);
+
+const CommandHandler command_table[] = {
+    command_msg,
+    command_broadcast,
+    command_create_group,
+    command_join_group,
+    command_group_msg,
+    command_leave_group,
+    command_pong,
+};
+
+// Maps a command word to its command. Every command word has a distinct length except
+// /broadcast and /group_msg, so a switch on the length leaves at most two comparisons.
+Command lookup_command(string_view word)
+{
+    switch (word.size())
+    {
+    case 4:
+        return word == "/msg" ? Command::Msg : Command::Unknown;
+    case 5:
+        return word == "/pong" ? Command::Pong : Command::Unknown;
+    case 10:
+        return word == "/broadcast" ? Command::Broadcast : word == "/group_msg" ? Command::GroupMsg : Command::Unknown;
+    case 11:
+        return word == "/join_group" ? Command::JoinGroup : Command::Unknown;
+    case 12:
+        return word == "/leave_group" ? Command::LeaveGroup : Command::Unknown;
+    case 13:
+        return word == "/create_group" ? Command::CreateGroup : Command::Unknown;
+    default:
+        return Command::Unknown;
+    }
+}
+
+// Processes one command from an authenticated client. The message is split into its
+// command word and arguments as views into the input buffer, so parsing and dispatch
+// allocate nothing.
+void handle_command(Connection &conn, string_view message)
+{
+    // Disconnect if client types "exit".
+    if (message == "exit")
+    {
+        send_reply(conn, "Goodbye.\n");
+        conn.close_after_flush = true;
+        return;
+    }
+
+    // Ensure the message is not empty.
+    if (message.empty())
+    {
+        send_reply(conn, "Error: Message cannot be empty.\n");
+        return;
+    }
+
+    size_t space = message.find(' ');
+    string_view word = message.substr(0, space);
+    bool has_args = space != string_view::npos;
+    string_view args = has_args ? message.substr(space + 1) : string_view();
+
+    uint64_t start = now_ns();
+    Command command = lookup_command(word);
+    if (command != Command::Pong)
+        conn.last_command = start;
+    if (command == Command::Unknown)
+        send_reply(conn, "Error: Unknown command.\n");
+    else
+        command_table[(size_t)command](conn, args, has_args);
+    ThreadMetrics &metrics = local_metrics();
+    metrics.commands[(size_t)command].add();
+    metrics.command_latency_ns[(size_t)command].record(now_ns() - start);
+}
+
+// Tears down a connection: announces the departure of authenticated users,
+// removes the socket from the event loop and releases its state.
+void close_connection(int fd)
+{
+    auto it = shard->connections.find(fd);
+    if (it == shard->connections.end())
+        return;
+    ConnectionPtr conn = std::move(it->second);
+    shard->connections.erase(it);
+    shard->timers.cancel(conn->timer);
+
+    // --- Client Disconnection ---
+    // Leaving every joined group costs O(groups joined), and no group is left holding
+    // a closed socket.
+    while (!conn->joined_groups.empty())
+        leave_group(*conn, conn->joined_groups.begin()->first);
+    local_metrics().connections_closed.add();
+    set_framing(*conn, Framing::Line);
+    if (conn->state == ConnState::Active)
+    {
+        active_clients.fetch_sub(1, memory_order_relaxed);
+        clients.erase(conn->username, conn->session);
+        cluster_publish(PeerOp::UserOffline, conn->username);
+        broadcast_message(conn->session, make_payload(conn->username, " has left the chat.\n"));
+        cout << conn->username << " disconnected." << endl;
+    }
+    if (shard->ring)
+    {
+        // Operations still in flight may use the connection's buffers. Shutting the
+        // socket down completes them; the last completion frees the connection, and
+        // the fd stays open until then so it cannot be reused meanwhile.
+        conn->closing = true;
+        if (conn->recv_armed || conn->send_inflight)
+        {
+            shutdown(fd, SHUT_RDWR);
+            conn.release();
+            return;
+        }
+    }
+    else
+    {
+        epoll_ctl(shard->epoll_fd, EPOLL_CTL_DEL, fd, nullptr);
+    }
+    close(fd);
+}
+
+// Allocates a connection from the calling shard's slab pool.
+ConnectionPtr new_connection()
+{
+    return ConnectionPtr(shard->connection_pool.create(), {&shard->connection_pool});
+}
+
+// Starts serving a newly accepted socket: watches it for input and prompts for the
+// username.
+void add_connection(int client_socket)
+{
+    if (!shard->ring)
+    {
+        epoll_event ev{};
+        ev.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+        ev.data.fd = client_socket;
+        if (epoll_ctl(shard->epoll_fd, EPOLL_CTL_ADD, client_socket, &ev) < 0)
+        {
+            cerr << "Error: Unable to watch client socket.\n";
+            close(client_socket);
+            return;
+        }
+    }
+    ConnectionPtr conn = new_connection();
+    conn->fd = client_socket;
+    conn->session = next_session.fetch_add(1, memory_order_relaxed);
+    conn->accepted_at = now_ns();
+    conn->timer.owner = conn.get();
+    shard->timers.schedule(conn->timer, auth_timeout_ms);
+    local_metrics().connections_opened.add();
+    Connection &ref = *conn;
+    shard->connections[client_socket] = std::move(conn);
+    // A socket accepted while the shard pauses is read by whichever process resumes.
+    ref.read_paused = shard->mode != ShardMode::Running;
+    if (shard->ring && !ref.read_paused)
+        arm_recv(ref);
+
+    // --- Authentication Phase ---
+    send_reply(ref, "Enter username: ");
+}
+
+// Accepts every pending connection on the shard's (edge-triggered) listening socket.
+void accept_clients()
+{
+    while (true)
+    {
+        sockaddr_in client_addr{};
+        socklen_t addr_len = sizeof(client_addr);
+        int client_socket = accept4(shard->listen_fd, (sockaddr *)&client_addr, &addr_len, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        local_metrics().io_syscalls.add();
+        if (client_socket < 0)
+        {
+            if (errno == EINTR || errno == ECONNABORTED)
+                continue;
+            if (errno != EAGAIN && errno != EWOULDBLOCK)
+                cerr << "Error: Failed to accept client connection.\n";
+            return;
+        }
+
+        add_connection(client_socket);
+    }
+}
+
+// Handles one complete frame from a client. "/frame length", "/frame binary" and
+// "/frame line" switch the framing used for the following frames, and for the server's
+// output from the reply on, and are accepted in any state.
+void handle_frame(Connection &conn, string_view message)
+{
+    if (message == "/frame length")
+    {
+        set_framing(conn, Framing::LengthPrefixed);
+        send_reply(conn, "Framing set to length-prefixed.\n");
+    }
+    else if (message == "/frame binary")
+    {
+        set_framing(conn, Framing::Binary);
+        send_reply(conn, "Framing set to binary.\n");
+    }
+    else if (message == "/frame line")
+    {
+        set_framing(conn, Framing::Line);
+        send_reply(conn, "Framing set to line.\n");
+    }
+    else if (conn.state == ConnState::Active)
+        handle_command(conn, message);
+    else
+        handle_auth(conn, message);
+}
+
+// Handles one binary frame. Text frames go through the text protocol. The others carry
+// a hot command with its arguments already apart, and names as interned ids, so they
+// need no tokenizing or dispatch by name.
+void handle_binary_frame(Connection &conn, FrameType type, string_view body)
+{
+    if (type == FrameType::Text)
+    {
+        handle_frame(conn, body);
+        return;
+    }
+    if (conn.state != ConnState::Active || type == FrameType::Name || type > FrameType::Group)
+    {
+        send_reply(conn, "Error: Unexpected frame.\n");
+        conn.close_after_flush = true;
+        return;
+    }
+    uint64_t start = now_ns();
+    conn.last_command = start;
+    Command command = type == FrameType::Direct ? Command::Msg : type == FrameType::Broadcast ? Command::Broadcast : Command::GroupMsg;
+    uint64_t id;
+    string_view name;
+    if (command == Command::Broadcast)
+        broadcast_text(conn, body);
+    else if (!take_varint(body, id) || !interned_name(id, name))
+        send_reply(conn, "Error: Unknown name id.\n");
+    else if (command == Command::Msg)
+        private_message(conn, name, body);
+    else
+        group_text(conn, name, body);
+    ThreadMetrics &metrics = local_metrics();
+    metrics.commands[(size_t)command].add();
+    metrics.command_latency_ns[(size_t)command].record(now_ns() - start);
+}
+
+// Parses and handles every complete frame at the start of 'input', passing each one on
+// as a view into it, and returns the number of bytes consumed. A frame longer than
+// MAX_FRAME_SIZE is a protocol error that closes the connection. Parsing stops early
+// while the client's own outbound queue is full.
+size_t parse_input(Connection &conn, string_view input)
+{
+    size_t pos = 0;
+    while (!conn.close_after_flush && !input_held(conn))
+    {
+        size_t available = input.size() - pos;
+        string_view message;
+        bool binary = conn.framing == Framing::Binary;
+        FrameType type = FrameType::Text;
+        if (binary)
+        {
+            if (available < 2)
+                break;
+            string_view rest = input.substr(pos + 1);
+            uint64_t length;
+            if (!take_varint(rest, length))
+            {
+                if (available > FRAME_HEADER_MAX)
+                {
+                    send_reply(conn, "Error: Malformed frame.\n");
+                    conn.close_after_flush = true;
+                }
+                break;
+            }
+            if (length > MAX_FRAME_SIZE)
+            {
+                send_reply(conn, "Error: Message too long.\n");
+                conn.close_after_flush = true;
+                break;
+            }
+            if (rest.size() < length)
+                break;
+            type = (FrameType)input[pos];
+            message = rest.substr(0, length);
+            pos = input.size() - rest.size() + length;
+        }
+        else if (conn.framing == Framing::Line)
+        {
+            size_t newline = input.find('\n', pos);
+            if (newline == string::npos)
+            {
+                if (available > MAX_FRAME_SIZE)
+                {
+                    send_reply(conn, "Error: Message too long.\n");
+                    conn.close_after_flush = true;
+                }
+                break;
+            }
+            size_t end = newline;
+            if (end > pos && input[end - 1] == '\r')
+                end--;
+            message = input.substr(pos, end - pos);
+            pos = newline + 1;
+        }
+        else
+        {
+            if (available < 4)
+                break;
+            const unsigned char *header = (const unsigned char *)input.data() + pos;
+            uint32_t length = (uint32_t(header[0]) << 24) | (uint32_t(header[1]) << 16) |
+                              (uint32_t(header[2]) << 8) | uint32_t(header[3]);
+            if (length > MAX_FRAME_SIZE)
+            {
+                send_reply(conn, "Error: Message too long.\n");
+                conn.close_after_flush = true;
+                break;
+            }
+            if (available - 4 < length)
+                break;
+            message = input.substr(pos + 4, length);
+            pos += 4 + length;
+        }
+        if (binary)
+            handle_binary_frame(conn, type, message);
+        else
+            handle_frame(conn, message);
+    }
+    return pos;
+}
+
+// Handles the complete frames in the connection's input buffer and drops them. A
+// partial frame stays buffered until the rest arrives; an emptied buffer is freed, so
+// only connections with a partial frame hold one.
+void process_input(Connection &conn)
+{
+    conn.inbuf.erase(0, parse_input(conn, conn.inbuf));
+    if (conn.inbuf.empty())
+        string().swap(conn.inbuf);
+}
+
+// Handles newly received bytes. Unless earlier input is still buffered, frames are
+// parsed straight out of the receive buffer and only a trailing partial frame is copied
+// into the connection. Input arriving while reading is paused is only buffered.
+void receive_input(Connection &conn, string_view input)
+{
+    if (conn.read_paused || conn.evicted)
+    {
+        conn.inbuf.append(input);
+        return;
+    }
+    if (!conn.inbuf.empty())
+    {
+        conn.inbuf.append(input);
+        process_input(conn);
+        return;
+    }
+    conn.inbuf.assign(input.substr(parse_input(conn, input)));
+}
+
+
+// Drains the socket (required with edge-triggered epoll) through the shard's receive
+// buffer and handles every complete command after each read, so pipelined commands
+// that arrive together are all processed. Returns false if the connection should be closed.
+// While the client's outbound queue is full, reading pauses (applying backpressure to a
+// client that sends without reading) and resumes once the queue has been flushed.
+// Reading also pauses while the client's password is being verified.
+bool read_client(Connection &conn)
+{
+    // Commands left over from a pause come first.
+    process_input(conn);
+    if (shard->ring)
+    {
+        // The multishot recv delivers input as it arrives; only pausing and resuming
+        // it is needed here.
+        if (input_held(conn))
+        {
+            conn.read_paused = true;
+            cancel_recv(conn);
+        }
+        else if (!conn.recv_armed && !conn.close_after_flush)
+            arm_recv(conn);
+        return true;
+    }
+    while (!conn.close_after_flush)
+    {
+        if (input_held(conn))
+        {
+            conn.read_paused = true;
+            return true;
+        }
+        ssize_t bytes_received = recv(conn.fd, shard->recv_buffer.get(), RECV_BUFFER_SIZE, 0);
+        local_metrics().io_syscalls.add();
+        if (bytes_received == 0)
+            return false;
+        if (bytes_received < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            return errno == EAGAIN || errno == EWOULDBLOCK;
+        }
+
+        local_metrics().bytes_in.add(bytes_received);
+        note_input(conn);
+        receive_input(conn, string_view(shard->recv_buffer.get(), bytes_received));
+    }
+    // Stop reading once the connection is being shut down.
+    return true;
+}
+
+// Handles one epoll event for a client socket.
+void handle_client_event(int fd, uint32_t events)
+{
+    auto it = shard->connections.find(fd);
+    if (it == shard->connections.end())
+        return;
+    Connection &conn = *it->second;
+
+    bool alive = !(events & EPOLLERR) && !conn.evicted;
+    if (alive && (events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP)) && !conn.close_after_flush && !conn.read_paused)
+        alive = read_client(conn);
+    if (!alive)
+        close_connection(fd);
+    else if (events & EPOLLOUT)
+        mark_dirty(conn);
+}
+
+// Writes the output queued during this round of events. Afterwards, paused readers whose
+// queues have drained resume reading, and connections waiting to close once their output
+// is written are closed.
+void flush_dirty()
+{
+    while (!shard->dirty.empty())
+    {
+        vector<pair<int, uint64_t>> dirty;
+        dirty.swap(shard->dirty);
+        for (auto &entry : dirty)
+        {
+            auto it = shard->connections.find(entry.first);
+            if (it == shard->connections.end() || it->second->session != entry.second)
+                continue;
+            Connection &conn = *it->second;
+            conn.dirty = false;
+            if (conn.evicted)
+                continue;
+
+            bool alive = flush_connection(conn);
+            if (alive && conn.read_paused && !input_held(conn))
+            {
+                conn.read_paused = false;
+                alive = read_client(conn);
+            }
+            if (alive && conn.close_after_flush && conn.outq.empty())
+                alive = false;
+            if (!alive)
+                close_connection(entry.first);
+        }
+    }
+}
+
+// Creates the shard's listening socket on the client port. Returns false on failure.
+bool open_listener(Shard &s, bool reuse_port)
 {
-    ifstream file(filename);
-    if (!file.is_open())
+    s.listen_fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (s.listen_fd < 0)
     {
-        cerr << "Error: Unable to open file \"" << filename << "\".\n";
+        cerr << "Error: Unable to create socket.\n";
+        return false;
+    }
+    int one = 1;
+    setsockopt(s.listen_fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    if (reuse_port && setsockopt(s.listen_fd, SOL_SOCKET, SO_REUSEPORT, &one, sizeof(one)) < 0)
+    {
+        cerr << "Error: Unable to set SO_REUSEPORT.\n";
+        return false;
+    }
+
+    // Set up the server address structure.
+    sockaddr_in server_addr{};
+    server_addr.sin_family = AF_INET;
+    server_addr.sin_port = htons(listen_port);
+    server_addr.sin_addr.s_addr = INADDR_ANY;
+
+    // Bind the socket to the specified port.
+    if (::bind(s.listen_fd, (sockaddr *)&server_addr, sizeof(server_addr)) < 0)
+    {
+        cerr << "Error: Unable to bind socket.\n";
+        return false;
+    }
+
+    // Listen for incoming connections.
+    if (listen(s.listen_fd, SOMAXCONN) < 0)
+    {
+        cerr << "Error: Unable to listen on port " << listen_port << ".\n";
+        return false;
+    }
+    return true;
+}
+
+// Creates a shard's listening socket, epoll instance, mailbox wakeup descriptor and
+// timer.
+// With several shards every shard binds its own socket to the port with SO_REUSEPORT, so
+// the kernel spreads incoming connections across them. A shard taking over from a
+// previous server process is given that process's listening socket in 'listen_fd'
+// instead. Returns false on failure.
+bool open_shard(Shard &s, bool reuse_port, int listen_fd = -1)
+{
+    s.listen_fd = listen_fd;
+    if (s.listen_fd < 0 && !open_listener(s, reuse_port))
+        return false;
+
+    // Create the event loop and register the listening socket and mailbox wakeups.
+    s.epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    s.wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (s.epoll_fd < 0 || s.wake_fd < 0)
+    {
+        cerr << "Error: Unable to create epoll instance.\n";
+        return false;
+    }
+    epoll_event ev{};
+    ev.events = EPOLLIN | EPOLLET;
+    ev.data.fd = s.listen_fd;
+    if (epoll_ctl(s.epoll_fd, EPOLL_CTL_ADD, s.listen_fd, &ev) < 0)
+    {
+        cerr << "Error: Unable to watch listening socket.\n";
+        return false;
+    }
+    ev.data.fd = s.wake_fd;
+    if (epoll_ctl(s.epoll_fd, EPOLL_CTL_ADD, s.wake_fd, &ev) < 0)
+    {
+        cerr << "Error: Unable to watch mailbox.\n";
+        return false;
+    }
+
+    // Tick the connection timers.
+    s.timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    itimerspec tick{};
+    tick.it_interval.tv_nsec = TIMER_TICK_MS * 1000000;
+    tick.it_value = tick.it_interval;
+    ev.data.fd = s.timer_fd;
+    if (s.timer_fd < 0 || timerfd_settime(s.timer_fd, 0, &tick, nullptr) < 0 ||
+        epoll_ctl(s.epoll_fd, EPOLL_CTL_ADD, s.timer_fd, &ev) < 0)
+    {
+        cerr << "Error: Unable to create timer.\n";
+        return false;
+    }
+    return true;
+}
+
+// Flushes the output of the current round and closes the slow consumers evicted while
+// handling it. Closing one sends departure notices, which may evict more.
+void finish_round()
+{
+    flush_dirty();
+    while (!shard->evictions.empty())
+    {
+        vector<pair<int, uint64_t>> evictions;
+        evictions.swap(shard->evictions);
+        for (auto &eviction : evictions)
+        {
+            auto it = shard->connections.find(eviction.first);
+            if (it != shard->connections.end() && it->second->session == eviction.second)
+            {
+                cout << "Disconnecting slow consumer " << it->second->username << "." << endl;
+                close_connection(eviction.first);
+            }
+        }
+        flush_dirty();
+    }
+}
+
+// Handles a connection whose timer fired. A client that has not logged in by its
+// deadline is turned away. An active user without commands for 'idle_timeout_ms' is
+// disconnected. A client silent for 'ping_interval_ms' is sent "/ping"; if it still
+// sends nothing for another interval, the connection is presumed dead (e.g. half-open
+// after the peer vanished) and closed at once, since nothing could be flushed to it.
+// A connection waiting to flush its last reply gets CLOSE_GRACE_MS more; a peer that
+// does not take the reply in that time (zero window, half-open) is closed regardless.
+void handle_timeout(Connection &conn)
+{
+    ThreadMetrics &metrics = local_metrics();
+    uint64_t now = now_ns();
+    if (conn.close_after_flush)
+    {
+        if (conn.close_grace)
+        {
+            close_connection(conn.fd);
+            return;
+        }
+        conn.close_grace = true;
+        shard->timers.schedule(conn.timer, CLOSE_GRACE_MS);
         return;
     }
-    string line;
-    while (getline(file, line))
+    if (conn.state == ConnState::Authenticating)
+    {
+        // The verdict is on its way; the login is finished or refused then.
+        shard->timers.schedule(conn.timer, TIMER_TICK_MS);
+        return;
+    }
+    if (conn.state != ConnState::Active)
+    {
+        metrics.auth_timeouts.add();
+        send_reply(conn, "Error: Login timed out.\n");
+        conn.close_after_flush = true;
+        conn.close_grace = true;
+        shard->timers.schedule(conn.timer, CLOSE_GRACE_MS);
+        return;
+    }
+    if (idle_timeout_ms && now - conn.last_command >= idle_timeout_ms * 1000000)
+    {
+        metrics.idle_disconnects.add();
+        cout << "Disconnecting idle user " << conn.username << "." << endl;
+        send_reply(conn, "Disconnected for inactivity.\n");
+        conn.close_after_flush = true;
+        conn.close_grace = true;
+        shard->timers.schedule(conn.timer, CLOSE_GRACE_MS);
+        return;
+    }
+    if (ping_interval_ms && conn.ping_sent_at && now - conn.ping_sent_at >= ping_interval_ms * 1000000)
+    {
+        metrics.heartbeat_timeouts.add();
+        cout << "Connection of " << conn.username << " timed out." << endl;
+        close_connection(conn.fd);
+        return;
+    }
+    if (ping_interval_ms && !conn.ping_sent_at && now - conn.last_input >= ping_interval_ms * 1000000)
+    {
+        metrics.pings_sent.add();
+        conn.ping_sent_at = now;
+        send_reply(conn, "/ping\n");
+    }
+    schedule_checks(conn, now);
+}
+
+// Advances the shard's timer wheel by the ticks elapsed since the last call and
+// handles the connections whose timers fired.
+void run_timers()
+{
+    uint64_t ticks = 0;
+    if (read(shard->timer_fd, &ticks, sizeof(ticks)) < 0)
+        return;
+    if (shard->mode == ShardMode::Quiet)
+    {
+        // A timeout could post mail to a shard that is already saved.
+        shard->held_ticks += ticks;
+        return;
+    }
+    ticks += shard->held_ticks;
+    shard->held_ticks = 0;
+    vector<pair<int, uint64_t>> fired;
+    while (ticks--)
+        shard->timers.tick([&fired](Connection *conn)
+                           { fired.emplace_back(conn->fd, conn->session); });
+    for (auto &entry : fired)
+    {
+        auto it = shard->connections.find(entry.first);
+        if (it != shard->connections.end() && it->second->session == entry.second && !it->second->evicted)
+            handle_timeout(*it->second);
+    }
+}
+
+// --- io_uring Event Handling ---
+
+// Frees a closed connection once its last io_uring operation has completed.
+void release_if_idle(Connection *conn)
+{
+    if (conn->recv_armed || conn->send_inflight)
+        return;
+    close(conn->fd);
+    shard->connection_pool.destroy(conn);
+}
+
+// Starts a multishot accept on the shard's listening socket.
+void arm_accept()
+{
+    io_uring_sqe *sqe = shard->ring->get_sqe();
+    sqe->opcode = IORING_OP_ACCEPT;
+    sqe->fd = shard->listen_fd;
+    sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+    sqe->accept_flags = SOCK_NONBLOCK | SOCK_CLOEXEC;
+    sqe->user_data = OpAccept;
+    shard->accept_armed = true;
+}
+
+// Starts a multishot poll on the shard's mailbox wakeup descriptor.
+void arm_wake()
+{
+    io_uring_sqe *sqe = shard->ring->get_sqe();
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = shard->wake_fd;
+    sqe->poll32_events = POLLIN;
+    sqe->len = IORING_POLL_ADD_MULTI;
+    sqe->user_data = OpWake;
+}
+
+// Starts a multishot poll for the shard's timer ticks.
+void arm_timer()
+{
+    io_uring_sqe *sqe = shard->ring->get_sqe();
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = shard->timer_fd;
+    sqe->poll32_events = POLLIN;
+    sqe->len = IORING_POLL_ADD_MULTI;
+    sqe->user_data = OpTimer;
+}
+
+// Handles input delivered by a connection's multishot recv. Commands are parsed out of
+// the provided buffer, which then goes straight back to the kernel.
+void handle_recv_completion(Connection &conn, const io_uring_cqe &cqe)
+{
+    if (!(cqe.flags & IORING_CQE_F_MORE))
+        conn.recv_armed = false;
+    bool has_buffer = cqe.flags & IORING_CQE_F_BUFFER;
+    unsigned id = cqe.flags >> IORING_CQE_BUFFER_SHIFT;
+    if (conn.closing)
+    {
+        if (has_buffer)
+            shard->ring->recycle(id);
+        release_if_idle(&conn);
+        return;
+    }
+
+    // Running out of provided buffers or a cancellation for a pause only ends the
+    // multishot recv; read_client re-arms it when appropriate.
+    bool alive = cqe.res > 0 || cqe.res == -ENOBUFS || cqe.res == -ECANCELED;
+    if (cqe.res > 0)
+    {
+        local_metrics().bytes_in.add(cqe.res);
+        note_input(conn);
+    }
+    if (has_buffer)
+    {
+        if (cqe.res > 0)
+            receive_input(conn, string_view(shard->ring->buffer(id), cqe.res));
+        shard->ring->recycle(id);
+    }
+    if (alive && !conn.evicted && !conn.read_paused && !conn.close_after_flush)
+        alive = read_client(conn);
+    if (!alive)
+        close_connection(conn.fd);
+}
+
+// Handles a completed sendmsg. Whatever is left or was queued meanwhile is sent at the
+// end of the round, which also resumes a paused reader or finishes a pending close.
+void handle_send_completion(Connection &conn, const io_uring_cqe &cqe)
+{
+    conn.send_inflight = false;
+    if (conn.closing)
+    {
+        release_if_idle(&conn);
+        return;
+    }
+    if (cqe.res == -ECANCELED)
+    {
+        // Cancelled by a freeze: the output is handed over, or sent again on resuming.
+        mark_dirty(conn);
+        return;
+    }
+    if (cqe.res < 0)
+    {
+        close_connection(conn.fd);
+        return;
+    }
+    consume_output(conn, cqe.res);
+    mark_dirty(conn);
+}
+
+// Dispatches one io_uring completion.
+void handle_completion(const io_uring_cqe &cqe)
+{
+    Connection *conn = (Connection *)(uintptr_t)(cqe.user_data & ~(uint64_t)OpMask);
+    switch (cqe.user_data & OpMask)
+    {
+    case OpAccept:
+        if (cqe.res >= 0)
+            add_connection(cqe.res);
+        else if (cqe.res != -ECONNABORTED && cqe.res != -EINTR && cqe.res != -ECANCELED)
+            cerr << "Error: Failed to accept client connection.\n";
+        if (!(cqe.flags & IORING_CQE_F_MORE))
+        {
+            shard->accept_armed = false;
+            if (shard->mode == ShardMode::Running)
+                arm_accept();
+        }
+        break;
+    case OpWake:
+        drain_mailbox();
+        if (!(cqe.flags & IORING_CQE_F_MORE))
+            arm_wake();
+        break;
+    case OpTimer:
+        run_timers();
+        if (!(cqe.flags & IORING_CQE_F_MORE))
+            arm_timer();
+        break;
+    case OpRecv:
+        handle_recv_completion(*conn, cqe);
+        break;
+    case OpSend:
+        handle_send_completion(*conn, cqe);
+        break;
+    default:
+        break;
+    }
+}
+
+// Checks that the kernel supports the io_uring features the backend uses, including
+// multishot recv with provided buffers handed over through a buffer ring or not
+// (per 'buffer_ring'), by receiving one byte over a socket pair.
+bool io_uring_works(bool buffer_ring)
+{
+    IoRing ring;
+    int pair[2];
+    if (!ring.open(8, 8, buffer_ring) || socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, pair) < 0)
+        return false;
+    io_uring_sqe *sqe = ring.get_sqe();
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = pair[0];
+    sqe->ioprio = IORING_RECV_MULTISHOT;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->user_data = OpRecv;
+    bool supported = write(pair[1], "x", 1) == 1 && ring.submit_and_wait(1) >= 0;
+    bool received = false;
+    ring.reap([&received](const io_uring_cqe &cqe)
+              { received = cqe.res == 1 && (cqe.flags & IORING_CQE_F_MORE); });
+    close(pair[0]);
+    close(pair[1]);
+    return supported && received;
+}
+
+// --- Hot Upgrade ---
+// With --upgrade-socket PATH, a new server process started with --takeover PATH takes
+// over from the running one without dropping a client:
+// 1. Pause: every shard stops accepting and reading, so no new command starts, while
+//    queued output and mail keep flowing and pending logins are verified.
+// 2. Freeze: the cluster thread stops first, after handing the frames it has read to
+//    the shards. Each shard cancels its io_uring sends, so a client that stopped
+//    reading cannot hold it up, and turns quiet once nothing it started is still
+//    running (a login being verified, an io_uring operation in flight).
+// 3. Save: once every shard is quiet, so no shard posts mail any more, each one
+//    serializes its connections, unsent output included, and blocks.
+// 4. Transfer: the listening sockets and client sockets, and the serialized state, go
+//    to the new process over the Unix socket (see "Process Handover" below).
+// The new process restores every connection as it was, including unread input, unsent
+// output and group memberships, so clients only notice a short pause. If the transfer
+// fails, or the shards do not all freeze within HANDOVER_TIMEOUT_S, the old process
+// resumes instead.
+
+mutex handover_mutex;
+condition_variable handover_cv;
+bool handover_active = false; // Frozen shards stay frozen while this is set.
+size_t shards_paused = 0;
+size_t shards_quiet = 0;
+size_t shards_frozen = 0;
+bool cluster_parked = false;
+
+// Called by the cluster thread at the end of a round once a handover asks it to stop.
+// Everything it read has been applied and everything queued for peers written by then;
+// it reads nothing more until the handover fails. Frames peers send meanwhile stay in
+// the links, which close with the process if the handover succeeds.
+void park_cluster()
+{
+    unique_lock<mutex> lock(handover_mutex);
+    cluster_parked = true;
+    handover_cv.notify_all();
+    while (cluster_park.load())
+        handover_cv.wait(lock);
+    cluster_parked = false;
+    handover_cv.notify_all();
+}
+
+// Handover state: fixed-width integers and length-prefixed strings. Both processes run
+// on the same host, so integers keep their native byte order.
+struct StateWriter
+{
+    string out;
+
+    void number(uint64_t value) { out.append((const char *)&value, sizeof(value)); }
+
+    void text(string_view s)
+    {
+        number(s.size());
+        out.append(s);
+    }
+};
+
+// Reads what a StateWriter wrote. Reading past the end clears 'ok' and yields zeros.
+struct StateReader
+{
+    string_view in;
+    bool ok = true;
+
+    uint64_t number()
+    {
+        uint64_t value = 0;
+        if (in.size() < sizeof(value))
+        {
+            ok = false;
+            return 0;
+        }
+        memcpy(&value, in.data(), sizeof(value));
+        in.remove_prefix(sizeof(value));
+        return value;
+    }
+
+    string_view text()
+    {
+        uint64_t length = number();
+        if (in.size() < length)
+        {
+            ok = false;
+            return {};
+        }
+        string_view s = in.substr(0, length);
+        in.remove_prefix(length);
+        return s;
+    }
+};
+
+// Pause step, on each shard. Input that arrives meanwhile stays in the socket or, with
+// io_uring, in the input buffer, for whichever process resumes reading.
+void pause_shard()
+{
+    shard->mode = ShardMode::Paused;
+    if (shard->ring)
+    {
+        if (shard->accept_armed)
+        {
+            io_uring_sqe *sqe = shard->ring->get_sqe();
+            sqe->opcode = IORING_OP_ASYNC_CANCEL;
+            sqe->addr = OpAccept;
+            sqe->user_data = OpIgnore;
+        }
+    }
+    else
+    {
+        epoll_ctl(shard->epoll_fd, EPOLL_CTL_DEL, shard->listen_fd, nullptr);
+    }
+    for (auto &entry : shard->connections)
+    {
+        entry.second->read_paused = true;
+        if (shard->ring)
+            cancel_recv(*entry.second);
+    }
+    lock_guard<mutex> lock(handover_mutex);
+    shards_paused++;
+    handover_cv.notify_all();
+}
+
+// Freeze step, on each shard. Sends in flight are cancelled; their unsent bytes are
+// handed over, or sent again if the shard resumes.
+void start_freeze()
+{
+    shard->mode = ShardMode::Freezing;
+    if (shard->ring)
+        for (auto &entry : shard->connections)
+            cancel_send(*entry.second);
+}
+
+// Undoes a pause after a failed handover. Flushing every connection resumes its reading.
+void resume_shard()
+{
+    shard->mode = ShardMode::Running;
+    if (shard->ring)
+    {
+        if (!shard->accept_armed)
+            arm_accept();
+    }
+    else
+    {
+        epoll_event ev{};
+        ev.events = EPOLLIN | EPOLLET;
+        ev.data.fd = shard->listen_fd;
+        epoll_ctl(shard->epoll_fd, EPOLL_CTL_ADD, shard->listen_fd, &ev);
+    }
+    for (auto &entry : shard->connections)
+        mark_dirty(*entry.second);
+    finish_round();
+}
+
+// Serializes a connection for the new process. Its unsent output is flattened into
+// one piece.
+void save_connection(StateWriter &state, const Connection &conn)
+{
+    state.number(conn.session);
+    state.number((uint64_t)conn.state);
+    state.text(conn.username);
+    state.number((uint64_t)conn.framing);
+    state.number(conn.close_after_flush);
+    state.text(conn.inbuf);
+    string output;
+    output.reserve(conn.queued_bytes);
+    size_t arena_cursor = conn.arena_consumed;
+    for (auto it = conn.outq.begin(); it != conn.outq.end(); ++it)
+    {
+        size_t offset = it == conn.outq.begin() ? conn.out_offset : 0;
+        const char *data = it->payload ? it->payload->data() + it->offset : conn.reply_arena.data() + arena_cursor;
+        if (!it->payload)
+            arena_cursor += it->length;
+        output.append(data + offset, it->length - offset);
+    }
+    state.text(output);
+    state.number(conn.skipped);
+    state.number(conn.accepted_at);
+    state.number(conn.last_input);
+    state.number(conn.last_command);
+    state.number(conn.ping_sent_at);
+    state.number(conn.rate_full_at);
+    state.number(conn.joined_groups.size());
+    for (auto &entry : conn.joined_groups)
+        state.text(entry.first->name);
+    state.number(conn.known_names.size());
+    for (auto &entry : conn.known_names)
+        state.number(entry.first);
+}
+
+// Freeze step, called after each round of a freezing shard until nothing the shard
+// started is still running. Then the shard turns quiet. It still handles its mail,
+// such as the broadcast of a login another shard is finishing, until every shard is
+// quiet and none posts any more.
+void freeze_shard()
+{
+    if (shard->accept_armed)
+        return;
+    for (auto &entry : shard->connections)
+    {
+        const Connection &conn = *entry.second;
+        if (conn.state == ConnState::Authenticating || conn.recv_armed || conn.send_inflight)
+            return;
+    }
+    shard->mode = ShardMode::Quiet;
+    lock_guard<mutex> lock(handover_mutex);
+    shards_quiet++;
+    handover_cv.notify_all();
+}
+
+// Save step, on each quiet shard: serializes the connections into 'handover_state' and
+// 'handover_fds' and blocks until the handover ends: the process exits meanwhile if it
+// succeeds, and the shard resumes if it fails. Timestamps are CLOCK_MONOTONIC readings,
+// which mean the same in the new process.
+void save_shard()
+{
+    StateWriter state;
+    shard->handover_fds.clear();
+    for (auto &entry : shard->connections)
+    {
+        if (entry.second->evicted)
+            continue;
+        save_connection(state, *entry.second);
+        shard->handover_fds.push_back(entry.first);
+    }
+    shard->handover_state = std::move(state.out);
+    shard->mode = ShardMode::Frozen;
+
+    unique_lock<mutex> lock(handover_mutex);
+    shards_frozen++;
+    handover_cv.notify_all();
+    while (handover_active)
+        handover_cv.wait(lock);
+    shards_frozen--;
+    handover_cv.notify_all();
+    lock.unlock();
+    shard->handover_state.clear();
+    resume_shard();
+}
+
+// Restores the connections the old process handed to the calling shard. Each one
+// carries on where it stopped: its unsent output goes out first, then the commands it
+// had buffered are handled and reading resumes.
+void restore_connections()
+{
+    StateReader state{shard->handover_state};
+    uint64_t now = now_ns();
+    for (int fd : shard->handover_fds)
+    {
+        ConnectionPtr conn = new_connection();
+        conn->fd = fd;
+        conn->session = state.number();
+        conn->state = (ConnState)state.number();
+        conn->username = state.text();
+        Framing framing = (Framing)state.number();
+        conn->close_after_flush = state.number();
+        conn->inbuf = state.text();
+        string_view output = state.text();
+        conn->skipped = state.number();
+        conn->accepted_at = state.number();
+        conn->last_input = state.number();
+        conn->last_command = state.number();
+        conn->ping_sent_at = state.number();
+        conn->rate_full_at = state.number();
+        vector<string_view> group_names(state.number());
+        for (string_view &name : group_names)
+            name = state.text();
+        for (uint64_t known = state.number(); known > 0 && state.ok; known--)
+            conn->known_names.emplace(state.number(), true);
+
+        epoll_event ev{};
+        ev.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+        ev.data.fd = fd;
+        if (!state.ok || (!shard->ring && epoll_ctl(shard->epoll_fd, EPOLL_CTL_ADD, fd, &ev) < 0))
+        {
+            close(fd);
+            continue;
+        }
+        Connection &ref = *conn;
+        ref.timer.owner = &ref;
+        shard->connections[fd] = std::move(conn);
+        set_framing(ref, framing);
+        if (ref.state == ConnState::Active)
+        {
+            ref.name_id = intern_name(ref.username);
+            clients.insert(ref.username, ClientInfo{shard->id, fd, ref.session});
+            cluster_publish(PeerOp::UserOnline, ref.username);
+            active_clients.fetch_add(1, memory_order_relaxed);
+            schedule_checks(ref, now);
+        }
+        else
+        {
+            uint64_t deadline = ref.accepted_at + auth_timeout_ms * 1000000;
+            shard->timers.schedule(ref.timer, deadline > now ? (deadline - now) / 1000000 : 0);
+        }
+        for (string_view name : group_names)
+        {
+            bool created;
+            join_group(ref, get_or_create_group(name, created));
+        }
+        if (!output.empty())
+        {
+            ref.outq.push_back(OutChunk{make_payload(output), output.size(), 0});
+            output_queued(ref, output.size());
+        }
+        ref.read_paused = true;
+        mark_dirty(ref);
+    }
+    if (!shard->handover_fds.empty())
+        cout << "Shard " << shard->id << " took over " << shard->connections.size() << " connection(s)." << endl;
+    shard->handover_state.clear();
+    shard->handover_fds.clear();
+    finish_round();
+}
+
+// --- Event Loop ---
+// Each shard thread multiplexes the client sockets it accepted. Sockets are non-blocking
+// and edge-triggered, so each ready socket is drained before waiting again.
+void run_epoll_loop()
+{
+    epoll_event events[MAX_EVENTS];
+    while (true)
+    {
+        int ready = epoll_wait(shard->epoll_fd, events, MAX_EVENTS, -1);
+        local_metrics().io_syscalls.add();
+        if (ready < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            cerr << "Error: epoll_wait failed.\n";
+            break;
+        }
+        for (int i = 0; i < ready; i++)
+        {
+            int fd = events[i].data.fd;
+            if (fd == shard->listen_fd)
+                accept_clients();
+            else if (fd == shard->wake_fd)
+                drain_mailbox();
+            else if (fd == shard->timer_fd)
+                run_timers();
+            else
+                handle_client_event(fd, events[i].events);
+        }
+        finish_round();
+        if (shard->mode == ShardMode::Freezing)
+            freeze_shard();
+    }
+}
+
+// With the io_uring backend, accepts, receives and mailbox wakeups are multishot
+// operations that stay armed, and each round ends with a single io_uring_enter that
+// submits the round's sends and waits for more completions. A connection has at most
+// one send in flight, so rounds are kept short (RING_BATCH completions) to bound how
+// much fan-out piles up in a queue meanwhile, and send completions are handled first
+// so that queues drain before the round's input fans out more messages.
+void run_ring_loop()
+{
+    arm_accept();
+    arm_wake();
+    arm_timer();
+    vector<io_uring_cqe> completions;
+    completions.reserve(RING_BATCH);
+    while (true)
+    {
+        int ret = shard->ring->submit_and_wait(1);
+        if (ret < 0 && ret != -EINTR && ret != -EBUSY)
+        {
+            cerr << "Error: io_uring_enter failed.\n";
+            break;
+        }
+        completions.clear();
+        shard->ring->reap([&completions](const io_uring_cqe &cqe)
+                          { completions.push_back(cqe); }, RING_BATCH);
+        for (const io_uring_cqe &cqe : completions)
+        {
+            if ((cqe.user_data & OpMask) == OpSend)
+                handle_completion(cqe);
+        }
+        for (const io_uring_cqe &cqe : completions)
+        {
+            if ((cqe.user_data & OpMask) != OpSend)
+                handle_completion(cqe);
+        }
+        finish_round();
+        if (shard->mode == ShardMode::Freezing)
+            freeze_shard();
+    }
+}
+
+// Runs a shard on the calling thread, starting with any connections handed over by a
+// previous server process. The ring is created here because it is restricted to a
+// single submitting thread.
+void run_shard(Shard *s)
+{
+    shard = s;
+    if (use_io_uring)
+    {
+        auto ring = make_unique<IoRing>();
+        if (ring->open(RING_ENTRIES, RING_BUFFERS, use_buffer_ring))
+            shard->ring = std::move(ring);
+        else
+            cerr << "Error: Shard " << shard->id << " could not set up io_uring; using epoll.\n";
+    }
+    if (!shard->ring)
+        shard->recv_buffer = make_unique_for_overwrite<char[]>(RECV_BUFFER_SIZE);
+    restore_connections();
+    if (shard->ring)
+        run_ring_loop();
+    else
+        run_epoll_loop();
+}
+
+// --- Metrics Reporting ---
+
+// Sums one counter across every thread's metrics block.
+uint64_t total(Counter ThreadMetrics::*counter)
+{
+    uint64_t sum = 0;
+    for (auto &metrics : metrics_registry)
+        sum += ((*metrics).*counter).get();
+    return sum;
+}
+
+// Writes a histogram summed across threads in the Prometheus text format, with
+// cumulative buckets up to each power of two. Empty trailing buckets are omitted.
+// 'select' picks the histogram out of a thread's metrics block.
+template <typename Select>
+void render_histogram(ostringstream &out, const string &name, const string &labels, Select select)
+{
+    uint64_t buckets[HISTOGRAM_BUCKETS] = {};
+    uint64_t count = 0, sum = 0;
+    for (auto &metrics : metrics_registry)
+    {
+        const Histogram &h = select(*metrics);
+        for (size_t i = 0; i < HISTOGRAM_BUCKETS; i++)
+            buckets[i] += h.buckets[i].get();
+        count += h.count.get();
+        sum += h.sum.get();
+    }
+    string separator = labels.empty() ? "" : ",";
+    uint64_t cumulative = 0;
+    for (size_t i = 0; i < HISTOGRAM_BUCKETS && cumulative < count; i++)
+    {
+        cumulative += buckets[i];
+        out << name << "_bucket{" << labels << separator << "le=\"" << ((1ULL << i) - 1) << "\"} " << cumulative << "\n";
+    }
+    out << name << "_bucket{" << labels << separator << "le=\"+Inf\"} " << count << "\n";
+    string braces = labels.empty() ? "" : "{" + labels + "}";
+    out << name << "_sum" << braces << " " << sum << "\n";
+    out << name << "_count" << braces << " " << count << "\n";
+}
+
+// Renders every metric as Prometheus-style text.
+string render_metrics()
+{
+    lock_guard<mutex> lock(metrics_registry_mutex);
+    ostringstream out;
+    const pair<const char *, Counter ThreadMetrics::*> counters[] = {
+        {"chat_bytes_in_total", &ThreadMetrics::bytes_in},
+        {"chat_bytes_out_total", &ThreadMetrics::bytes_out},
+        {"chat_connections_opened_total", &ThreadMetrics::connections_opened},
+        {"chat_connections_closed_total", &ThreadMetrics::connections_closed},
+        {"chat_logins_total", &ThreadMetrics::logins},
+        {"chat_auth_failures_total", &ThreadMetrics::auth_failures},
+        {"chat_auth_rejected_total", &ThreadMetrics::auth_rejected},
+        {"chat_mails_posted_total", &ThreadMetrics::mails_posted},
+        {"chat_messages_dropped_total", &ThreadMetrics::messages_dropped},
+        {"chat_slow_disconnects_total", &ThreadMetrics::slow_disconnects},
+        {"chat_log_records_total", &ThreadMetrics::log_records},
+        {"chat_log_dropped_total", &ThreadMetrics::log_dropped},
+        {"chat_io_syscalls_total", &ThreadMetrics::io_syscalls},
+        {"chat_peer_frames_sent_total", &ThreadMetrics::peer_frames_sent},
+        {"chat_peer_frames_received_total", &ThreadMetrics::peer_frames_received},
+        {"chat_peer_writes_total", &ThreadMetrics::peer_writes},
+        {"chat_auth_timeouts_total", &ThreadMetrics::auth_timeouts},
+        {"chat_idle_disconnects_total", &ThreadMetrics::idle_disconnects},
+        {"chat_pings_sent_total", &ThreadMetrics::pings_sent},
+        {"chat_heartbeat_timeouts_total", &ThreadMetrics::heartbeat_timeouts},
+        {"chat_throttled_total{limit=\"user\"}", &ThreadMetrics::user_throttled},
+        {"chat_throttled_total{limit=\"group\"}", &ThreadMetrics::group_throttled},
+    };
+    for (auto &counter : counters)
+        out << counter.first << " " << total(counter.second) << "\n";
+    out << "chat_active_clients " << active_clients.load(memory_order_relaxed) << "\n";
+    out << "chat_groups " << groups.size() << "\n";
+    for (size_t i = 0; i < COMMAND_KINDS; i++)
+    {
+        uint64_t commands = 0;
+        for (auto &metrics : metrics_registry)
+            commands += metrics->commands[i].get();
+        out << "chat_commands_total{command=\"" << command_names[i] << "\"} " << commands << "\n";
+    }
+    for (size_t i = 0; i < COMMAND_KINDS; i++)
+        render_histogram(out, "chat_command_latency_ns", string("command=\"") + command_names[i] + "\"",
+                         [i](const ThreadMetrics &m) -> const Histogram & { return m.command_latency_ns[i]; });
+    render_histogram(out, "chat_auth_time_ns", "", mem_fn(&ThreadMetrics::auth_time_ns));
+    render_histogram(out, "chat_auth_wait_ns", "", mem_fn(&ThreadMetrics::auth_wait_ns));
+    render_histogram(out, "chat_auth_verify_ns", "", mem_fn(&ThreadMetrics::auth_verify_ns));
+    render_histogram(out, "chat_fanout_recipients", "", mem_fn(&ThreadMetrics::fanout_recipients));
+    render_histogram(out, "chat_queue_depth_bytes", "", mem_fn(&ThreadMetrics::queue_depth_bytes));
+    render_histogram(out, "chat_lock_wait_ns", "lock=\"clients\"", mem_fn(&ThreadMetrics::clients_lock_wait_ns));
+    render_histogram(out, "chat_lock_wait_ns", "lock=\"groups\"", mem_fn(&ThreadMetrics::groups_lock_wait_ns));
+    render_histogram(out, "chat_log_batch_records", "", mem_fn(&ThreadMetrics::log_batch_records));
+    render_histogram(out, "chat_log_commit_ns", "", mem_fn(&ThreadMetrics::log_commit_ns));
+    return out.str();
+}
+
+int metrics_listen_fd = -1;
+
+// Serves the metrics on 127.0.0.1:'port' from a thread of its own, away from the
+// shards. Each connection gets one snapshot and is closed; a request starting with
+// "GET" is answered with an HTTP header so that scrapers and curl work too. A socket
+// handed over by a previous server process is served as it is.
+bool start_metrics_endpoint(int port)
+{
+    if (metrics_listen_fd < 0)
     {
-        size_t pos = line.find(':');
-        if (pos != string::npos)
+        metrics_listen_fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        if (metrics_listen_fd < 0)
         {
-            string username = line.substr(0, pos);
-            string password = line.substr(pos + 1);
-            users[username] = password;
+            cerr << "Error: Unable to create metrics socket.\n";
+            return false;
+        }
+        int one = 1;
+        setsockopt(metrics_listen_fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+        sockaddr_in addr{};
+        addr.sin_family = AF_INET;
+        addr.sin_port = htons(port);
+        addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        if (::bind(metrics_listen_fd, (sockaddr *)&addr, sizeof(addr)) < 0 || listen(metrics_listen_fd, 16) < 0)
+        {
+            cerr << "Error: Unable to listen for metrics on port " << port << ".\n";
+            close(metrics_listen_fd);
+            metrics_listen_fd = -1;
+            return false;
         }
     }
-    file.close();
+    int listen_fd = metrics_listen_fd;
+    thread([listen_fd]()
+           {
+        while (true) {
+            int client = accept4(listen_fd, nullptr, nullptr, SOCK_CLOEXEC);
+            if (client < 0)
+                continue;
+            // Give a scraper a moment to send its request line; plain readers send nothing.
+            timeval timeout{0, 100000};
+            setsockopt(client, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+            char request[BUFFER_SIZE];
+            ssize_t n = recv(client, request, sizeof(request), 0);
+            string body = render_metrics();
+            string response;
+            if (n >= 3 && memcmp(request, "GET", 3) == 0)
+                response = "HTTP/1.0 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\nContent-Length: " + to_string(body.size()) + "\r\n\r\n";
+            response += body;
+            size_t sent = 0;
+            while (sent < response.size()) {
+                ssize_t w = send(client, response.data() + sent, response.size() - sent, MSG_NOSIGNAL);
+                if (w <= 0)
+                    break;
+                sent += w;
+            }
+            close(client);
+        } })
+        .detach();
+    return true;
 }
 
-// Helper function to check if a string contains any spaces.
-bool contains_space(const string &s)
+// --- Process Handover ---
+// The old process listens on the upgrade socket; the new one connects and sends
+// HANDOVER_MAGIC, its number of shards and its client, cluster and metrics ports (0 for
+// none), which must all match the old process's. The old process pauses and
+// freezes its shards and seals the message log, then sends the length of its state
+// and the state, and finally every socket, in SCM_RIGHTS messages of up to HANDOVER_FDS
+// descriptors: the shards' listening sockets, the cluster and metrics listening
+// sockets if it has them, and each shard's client sockets. The new process answers 'K'
+// once it holds everything, and the old process exits.
+
+// State received from the old process, applied by main().
+struct Handover
 {
-    return s.find(' ') != string::npos;
+    uint64_t next_session = 0;
+    vector<string> names;                  // Interned names, in id order.
+    vector<pair<string, uint64_t>> groups; // Name and rate limit state of every group.
+    vector<int> listen_fds;                // One per shard.
+    int cluster_listen_fd = -1;
+    int metrics_listen_fd = -1;
+    vector<string> states;                 // Serialized connections, per shard.
+    vector<vector<int>> fds;               // Their sockets, per shard.
+};
+
+// Returns the local port 'fd' is bound to, or 0 if it is not a bound socket.
+uint32_t socket_port(int fd)
+{
+    sockaddr_in addr{};
+    socklen_t length = sizeof(addr);
+    if (fd < 0 || getsockname(fd, (sockaddr *)&addr, &length) < 0)
+        return 0;
+    return ntohs(addr.sin_port);
 }
 
-// Sends a formatted group message to all members of a group except the sender.
-// Assumes that group existence and membership have already been validated.
-void group_message(int client_socket, const string &group_name, const string &message)
+bool send_all(int fd, const void *data, size_t size)
 {
-    lock_guard<mutex> lock(groups_mutex);
-    string full_message = "[Group " + group_name + "]: " + message + "\n";
-    for (int member_socket : groups[group_name])
+    for (size_t sent = 0; sent < size;)
     {
-        if (member_socket != client_socket)
-        {
-            send(member_socket, full_message.c_str(), full_message.size(), 0);
-        }
+        ssize_t n = send(fd, (const char *)data + sent, size - sent, MSG_NOSIGNAL);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return false;
+        sent += n;
     }
+    return true;
 }
 
-// Handles communication with a connected client.
-void handle_client(int client_socket)
+bool recv_all(int fd, void *data, size_t size)
 {
-    char buffer[BUFFER_SIZE];
-    string username;
-
-    // --- Authentication Phase ---
-    string prompt = "Enter username: ";
-    send(client_socket, prompt.c_str(), prompt.size(), 0);
-    memset(buffer, 0, BUFFER_SIZE);
-    int bytes_received = recv(client_socket, buffer, BUFFER_SIZE, 0);
-    if (bytes_received <= 0)
+    for (size_t received = 0; received < size;)
     {
-        close(client_socket);
-        return;
+        ssize_t n = recv(fd, (char *)data + received, size - received, 0);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return false;
+        received += n;
     }
-    username = string(buffer, bytes_received);
+    return true;
+}
+
+// Passes up to HANDOVER_FDS descriptors, attached to a single byte.
+bool send_fds(int fd, const int *fds, size_t count)
+{
+    char byte = 'F';
+    iovec iov{&byte, 1};
+    alignas(cmsghdr) char control[CMSG_SPACE(sizeof(int) * HANDOVER_FDS)];
+    msghdr msg{};
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = CMSG_SPACE(sizeof(int) * count);
+    cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int) * count);
+    memcpy(CMSG_DATA(cmsg), fds, sizeof(int) * count);
+    return sendmsg(fd, &msg, MSG_NOSIGNAL) == 1;
+}
+
+// Receives 'count' descriptors sent with send_fds, as close-on-exec descriptors of
+// this process.
+bool recv_fds(int fd, int *fds, size_t count)
+{
+    char byte;
+    iovec iov{&byte, 1};
+    alignas(cmsghdr) char control[CMSG_SPACE(sizeof(int) * HANDOVER_FDS)];
+    msghdr msg{};
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+    if (recvmsg(fd, &msg, MSG_CMSG_CLOEXEC) != 1)
+        return false;
+    cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    if (!cmsg || cmsg->cmsg_type != SCM_RIGHTS || cmsg->cmsg_len != CMSG_LEN(sizeof(int) * count))
+        return false;
+    memcpy(fds, CMSG_DATA(cmsg), sizeof(int) * count);
+    return true;
+}
+
+// Ends a failed handover: the log is unsealed, and every shard and the cluster thread
+// resume. Called with 'lock' held on handover_mutex.
+bool abandon_handover(unique_lock<mutex> &lock)
+{
+    log_sealed.store(false);
+    handover_active = false;
+    cluster_park.store(false);
+    handover_cv.notify_all();
+    lock.unlock();
+    // Shards that froze resume by themselves; the others are still pausing or freezing.
+    for (size_t i = 0; i < shards.size(); i++)
+        post_mail(i, new Mail(Mail::Resume));
+    lock.lock();
+    while (shards_frozen > 0 || cluster_parked)
+        handover_cv.wait(lock);
+    return false;
+}
 
-    string password_prompt = "Enter password: ";
-    send(client_socket, password_prompt.c_str(), password_prompt.size(), 0);
-    memset(buffer, 0, BUFFER_SIZE);
-    bytes_received = recv(client_socket, buffer, BUFFER_SIZE, 0);
-    if (bytes_received <= 0)
+// Hands the whole server over to the process on the other end of 'peer'. Returns true
+// once the new process has everything; false, with every shard resumed, on failure.
+bool hand_over(int peer)
+{
+    auto deadline = chrono::steady_clock::now() + chrono::seconds(HANDOVER_TIMEOUT_S);
+    unique_lock<mutex> lock(handover_mutex);
+    handover_active = true;
+    shards_paused = 0;
+    shards_quiet = 0;
+    lock.unlock();
+    for (size_t i = 0; i < shards.size(); i++)
+        post_mail(i, new Mail(Mail::Pause));
+    lock.lock();
+    bool ready = handover_cv.wait_until(lock, deadline, []
+                                        { return shards_paused == shards.size(); });
+    // With the shards paused, no new frames are queued for peers. The cluster thread
+    // stops before the shards freeze, so none of the mail it posts them is lost.
+    if (ready && cluster_epoll_fd >= 0)
     {
-        close(client_socket);
-        return;
+        cluster_park.store(true);
+        uint64_t one = 1;
+        ssize_t ignored = write(cluster_wake_fd, &one, sizeof(one));
+        (void)ignored;
+        ready = handover_cv.wait_until(lock, deadline, []
+                                       { return cluster_parked; });
+    }
+    lock.unlock();
+    // Mail is handled in order, so each shard has paused, and has the cluster thread's
+    // last mail, before it starts freezing.
+    if (ready)
+        for (size_t i = 0; i < shards.size(); i++)
+            post_mail(i, new Mail(Mail::Freeze));
+    lock.lock();
+    ready = ready && handover_cv.wait_until(lock, deadline, []
+                                            { return shards_quiet == shards.size(); });
+    lock.unlock();
+    // Each shard handles the mail other shards posted it before they turned quiet
+    // before it is saved.
+    if (ready)
+        for (size_t i = 0; i < shards.size(); i++)
+            post_mail(i, new Mail(Mail::Save));
+    lock.lock();
+    if (!ready || !handover_cv.wait_until(lock, deadline, []
+                                          { return shards_frozen == shards.size(); }))
+    {
+        cerr << "Error: The server did not freeze within " << HANDOVER_TIMEOUT_S << " s.\n";
+        return abandon_handover(lock);
     }
-    string password = string(buffer, bytes_received);
+    lock.unlock();
 
-    // Validate credentials.
-    if (users.find(username) != users.end() && users[username] == password)
+    // The new process recovers the log, so nothing may be written to it from now on.
+    log_sealed.store(true);
+    while (log_pending.load() > 0)
     {
+        if (chrono::steady_clock::now() >= deadline)
         {
-            // Prevent duplicate connections using the same username.
-            lock_guard<mutex> lock(clients_mutex);
-            for (const auto &client : clients)
-            {
-                if (client.second == username)
-                {
-                    string err = "Error: User \"" + username + "\" is already connected.\n";
-                    send(client_socket, err.c_str(), err.size(), 0);
-                    close(client_socket);
-                    return;
-                }
-            }
-            // Add the new client to the active client list.
-            clients[client_socket] = username;
+            cerr << "Error: The message log was not written within " << HANDOVER_TIMEOUT_S << " s.\n";
+            lock.lock();
+            return abandon_handover(lock);
+        }
+        this_thread::sleep_for(chrono::milliseconds(1));
+    }
 
-            // Inform other connected clients of the new connection.
-            string join_msg = username + " has joined the chat.\n";
-            for (const auto &client : clients)
-            {
-                if (client.first != client_socket)
-                {
-                    send(client.first, join_msg.c_str(), join_msg.size(), 0);
-                }
-            }
+    StateWriter state;
+    vector<int> fds;
+    state.number(next_session.load());
+    {
+        shared_lock<shared_mutex> names_lock(names_mutex);
+        state.number(interned_names.size());
+        for (const string &name : interned_names)
+            state.text(name);
+    }
+    {
+        vector<ChatGroup *> all_groups;
+        groups.for_each([&all_groups](ChatGroup &group)
+                        { all_groups.push_back(&group); });
+        state.number(all_groups.size());
+        for (ChatGroup *group : all_groups)
+        {
+            state.text(group->name);
+            state.number(group->rate_full_at.load(memory_order_relaxed));
         }
-        cout << username << " connected." << endl;
-        string welcome = "Welcome to the chat server!\n";
-        send(client_socket, welcome.c_str(), welcome.size(), 0);
+    }
+    for (auto &s : shards)
+        fds.push_back(s->listen_fd);
+    state.number(cluster_listen_fd >= 0);
+    if (cluster_listen_fd >= 0)
+        fds.push_back(cluster_listen_fd);
+    state.number(metrics_listen_fd >= 0);
+    if (metrics_listen_fd >= 0)
+        fds.push_back(metrics_listen_fd);
+    size_t connections = 0;
+    for (auto &s : shards)
+    {
+        state.text(s->handover_state);
+        state.number(s->handover_fds.size());
+        fds.insert(fds.end(), s->handover_fds.begin(), s->handover_fds.end());
+        connections += s->handover_fds.size();
+    }
+
+    uint64_t length = state.out.size();
+    bool sent = send_all(peer, &length, sizeof(length)) && send_all(peer, state.out.data(), length);
+    for (size_t i = 0; sent && i < fds.size(); i += HANDOVER_FDS)
+        sent = send_fds(peer, fds.data() + i, min<size_t>(HANDOVER_FDS, fds.size() - i));
+    char answer = 0;
+    if (sent && recv_all(peer, &answer, 1) && answer == 'K')
+    {
+        cout << "Handed " << connections << " connection(s) over to the new server process." << endl;
+        return true;
+    }
 
-        // --- Main Communication Loop ---
-        while (true)
+    lock.lock();
+    return abandon_handover(lock);
+}
+
+// Upgrade thread: serves takeover requests on the upgrade socket until one succeeds,
+// then ends the process. Its descriptors now belong to the new process, and the
+// shards are frozen, so it exits without running destructors.
+void run_upgrade_socket(int listen_fd)
+{
+    while (true)
+    {
+        int peer = accept4(listen_fd, nullptr, nullptr, SOCK_CLOEXEC);
+        if (peer < 0)
+            continue;
+        timeval timeout{HANDOVER_TIMEOUT_S, 0};
+        setsockopt(peer, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+        setsockopt(peer, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+        uint32_t hello[5];
+        if (!recv_all(peer, hello, sizeof(hello)) || hello[0] != HANDOVER_MAGIC)
         {
-            memset(buffer, 0, BUFFER_SIZE);
-            bytes_received = recv(client_socket, buffer, BUFFER_SIZE, 0);
-            if (bytes_received <= 0)
-                break;
+            close(peer);
+            continue;
+        }
+        if (hello[1] != shards.size())
+        {
+            cerr << "Error: Refused a takeover by a server with " << hello[1] << " shard(s); this one has "
+                 << shards.size() << ".\n";
+            close(peer);
+            continue;
+        }
+        if (hello[2] != (uint32_t)listen_port || hello[3] != socket_port(cluster_listen_fd) ||
+            hello[4] != socket_port(metrics_listen_fd))
+        {
+            cerr << "Error: Refused a takeover by a server on ports " << hello[2] << ", " << hello[3] << " and "
+                 << hello[4] << "; this one uses " << listen_port << ", " << socket_port(cluster_listen_fd)
+                 << " and " << socket_port(metrics_listen_fd) << " (client, cluster and metrics).\n";
+            close(peer);
+            continue;
+        }
+        cout << "Handing over to a new server process..." << endl;
+        if (hand_over(peer))
+            _exit(0);
+        cerr << "Error: The handover failed; resuming service.\n";
+        close(peer);
+    }
+}
 
-            string message = string(buffer, bytes_received);
+// Listens for takeover requests on the Unix socket 'path', replacing any socket a
+// previous server process left there. Returns false on failure.
+bool start_upgrade_socket(const string &path)
+{
+    sockaddr_un addr{};
+    addr.sun_family = AF_UNIX;
+    if (path.size() >= sizeof(addr.sun_path))
+    {
+        cerr << "Error: Upgrade socket path is too long.\n";
+        return false;
+    }
+    memcpy(addr.sun_path, path.c_str(), path.size() + 1);
+    int listen_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    unlink(path.c_str());
+    if (listen_fd < 0 || ::bind(listen_fd, (sockaddr *)&addr, sizeof(addr)) < 0 || listen(listen_fd, 1) < 0)
+    {
+        cerr << "Error: Unable to listen on upgrade socket \"" << path << "\".\n";
+        return false;
+    }
+    chmod(path.c_str(), 0600);
+    thread(run_upgrade_socket, listen_fd).detach();
+    return true;
+}
 
-            // Disconnect if client types "exit".
-            if (message == "exit")
-            {
-                string bye = "Goodbye.\n";
-                send(client_socket, bye.c_str(), bye.size(), 0);
-                break;
-            }
+// Takes over from the server process listening on the upgrade socket 'path', filling
+// in 'handover'. Returns false, leaving that process running, on failure, including
+// when that process has a different number of shards or different ports.
+bool take_over(const string &path, size_t shard_count, int metrics_port, Handover &handover)
+{
+    sockaddr_un addr{};
+    addr.sun_family = AF_UNIX;
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (path.size() >= sizeof(addr.sun_path) || fd < 0)
+        return false;
+    memcpy(addr.sun_path, path.c_str(), path.size() + 1);
+    timeval timeout{HANDOVER_TIMEOUT_S, 0};
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    uint32_t hello[5] = {HANDOVER_MAGIC, (uint32_t)shard_count, (uint32_t)listen_port,
+                         (uint32_t)(node_id >= 0 ? cluster_port : 0), (uint32_t)metrics_port};
+    uint64_t length;
+    string blob;
+    bool ok = connect(fd, (sockaddr *)&addr, sizeof(addr)) == 0 && send_all(fd, hello, sizeof(hello)) &&
+              recv_all(fd, &length, sizeof(length));
+    if (ok)
+    {
+        blob.resize(length);
+        ok = recv_all(fd, blob.data(), length);
+    }
 
-            // Ensure the message is not empty.
-            if (message.empty())
-            {
-                string err = "Error: Message cannot be empty.\n";
-                send(client_socket, err.c_str(), err.size(), 0);
-                continue;
-            }
+    StateReader state{blob};
+    handover.next_session = state.number();
+    handover.names.resize(ok ? state.number() : 0);
+    for (string &name : handover.names)
+        name = state.text();
+    handover.groups.resize(ok ? state.number() : 0);
+    for (auto &group : handover.groups)
+    {
+        group.first = state.text();
+        group.second = state.number();
+    }
+    bool has_cluster = state.number();
+    bool has_metrics = state.number();
+    size_t total = shard_count + has_cluster + has_metrics;
+    handover.states.resize(shard_count);
+    handover.fds.resize(shard_count);
+    for (size_t i = 0; i < shard_count; i++)
+    {
+        handover.states[i] = state.text();
+        handover.fds[i].resize(state.number());
+        total += handover.fds[i].size();
+    }
+    ok = ok && state.ok;
 
-            // Process commands based on their prefix.
-            // Command: /msg <username> <message>
-            if (message.substr(0, 4) == "/msg")
-            {
-                size_t space1 = message.find(' ', 5);
-                if (space1 == string::npos)
-                {
-                    string err = "Error: Incorrect format. Use: /msg <username> <message>\n";
-                    send(client_socket, err.c_str(), err.size(), 0);
-                    continue;
-                }
-                string target_user = message.substr(5, space1 - 5);
-                string private_msg = message.substr(space1 + 1);
-                if (private_msg.empty())
-                {
-                    string err = "Error: Private message content is empty.\n";
-                    send(client_socket, err.c_str(), err.size(), 0);
-                    continue;
-                }
-                int target_socket = -1;
-                {
-                    lock_guard<mutex> lock(clients_mutex);
-                    for (const auto &client : clients)
-                    {
-                        if (client.second == target_user)
-                        {
-                            target_socket = client.first;
-                            break;
-                        }
-                    }
-                }
-                if (target_socket != -1)
-                {
-                    if (target_socket == client_socket)
-                    {
-                        string self_msg = "Error: Cannot send a private message to yourself.\n";
-                        send(client_socket, self_msg.c_str(), self_msg.size(), 0);
-                    }
-                    else
-                    {
-                        string full_msg = "[" + username + "]: " + private_msg + "\n";
-                        send(target_socket, full_msg.c_str(), full_msg.size(), 0);
-                    }
-                }
-                else
-                {
-                    string not_found = "Error: User \"" + target_user + "\" not found.\n";
-                    send(client_socket, not_found.c_str(), not_found.size(), 0);
-                }
-            }
-            // Command: /broadcast <message>
-            else if (message.substr(0, 10) == "/broadcast")
-            {
-                if (message.size() <= 10 || message[10] != ' ')
-                {
-                    string err = "Error: Incorrect format. Use: /broadcast <message>\n";
-                    send(client_socket, err.c_str(), err.size(), 0);
-                    continue;
-                }
-                string broadcast_content = message.substr(11);
-                if (broadcast_content.empty())
-                {
-                    string err = "Error: Broadcast message content is empty.\n";
-                    send(client_socket, err.c_str(), err.size(), 0);
-                    continue;
-                }
-                string broadcast_msg = "[" + username + "] (Broadcast): " + broadcast_content + "\n";
-                lock_guard<mutex> lock(clients_mutex);
-                for (const auto &client : clients)
-                {
-                    if (client.first != client_socket)
-                        send(client.first, broadcast_msg.c_str(), broadcast_msg.size(), 0);
-                }
-            }
-            // Command: /create_group <group name>
-            else if (message.substr(0, 13) == "/create_group")
-            {
-                if (message.size() <= 13 || message[13] != ' ')
-                {
-                    string err = "Error: Incorrect format. Use: /create_group <group name>\n";
-                    send(client_socket, err.c_str(), err.size(), 0);
-                    continue;
-                }
-                string group_name = message.substr(14);
-                if (group_name.empty())
-                {
-                    string err = "Error: Group name cannot be empty.\n";
-                    send(client_socket, err.c_str(), err.size(), 0);
-                    continue;
-                }
-                // Check that group names do not contain spaces.
-                if (contains_space(group_name))
-                {
-                    string err = "Error: Group name must not contain spaces.\n";
-                    send(client_socket, err.c_str(), err.size(), 0);
-                    continue;
-                }
-                {
-                    lock_guard<mutex> lock(groups_mutex);
-                    if (!groups.count(group_name))
-                    {
-                        groups[group_name].insert(client_socket);
-                        string reply = "Group \"" + group_name + "\" created successfully.\n";
-                        send(client_socket, reply.c_str(), reply.size(), 0);
-                    }
-                    else
-                    {
-                        string reply = "Error: Group \"" + group_name + "\" already exists.\n";
-                        send(client_socket, reply.c_str(), reply.size(), 0);
-                    }
-                }
-            }
-            // Command: /join_group <group name>
-            else if (message.substr(0, 11) == "/join_group")
-            {
-                if (message.size() <= 11 || message[11] != ' ')
-                {
-                    string err = "Error: Incorrect format. Use: /join_group <group name>\n";
-                    send(client_socket, err.c_str(), err.size(), 0);
-                    continue;
-                }
-                string group_name = message.substr(12);
-                if (group_name.empty())
-                {
-                    string err = "Error: Group name cannot be empty.\n";
-                    send(client_socket, err.c_str(), err.size(), 0);
-                    continue;
-                }
-                {
-                    lock_guard<mutex> lock(groups_mutex);
-                    if (!groups.count(group_name))
-                    {
-                        string reply = "Error: Group \"" + group_name + "\" does not exist.\n";
-                        send(client_socket, reply.c_str(), reply.size(), 0);
-                    }
-                    else
-                    {
-                        // Prevent joining the same group more than once.
-                        if (groups[group_name].find(client_socket) != groups[group_name].end())
-                        {
-                            string err = "Error: Already a member of group \"" + group_name + "\".\n";
-                            send(client_socket, err.c_str(), err.size(), 0);
-                        }
-                        else
-                        {
-                            groups[group_name].insert(client_socket);
-                            string reply = "Joined group \"" + group_name + "\" successfully.\n";
-                            send(client_socket, reply.c_str(), reply.size(), 0);
-                        }
-                    }
-                }
-            }
-            // Command: /group_msg <group name> <message>
-            else if (message.substr(0, 10) == "/group_msg")
-            {
-                if (message.size() <= 10 || message[10] != ' ')
-                {
-                    string err = "Error: Incorrect format. Use: /group_msg <group name> <message>\n";
-                    send(client_socket, err.c_str(), err.size(), 0);
-                    continue;
-                }
-                size_t space1 = message.find(' ', 11);
-                if (space1 == string::npos)
-                {
-                    string err = "Error: Incorrect format. Use: /group_msg <group name> <message>\n";
-                    send(client_socket, err.c_str(), err.size(), 0);
-                    continue;
-                }
-                string group_name = message.substr(11, space1 - 11);
-                string group_msg = message.substr(space1 + 1);
-                if (group_msg.empty())
-                {
-                    string err = "Error: Group message content is empty.\n";
-                    send(client_socket, err.c_str(), err.size(), 0);
-                    continue;
-                }
-                {
-                    lock_guard<mutex> lock(groups_mutex);
-                    if (!groups.count(group_name))
-                    {
-                        string err = "Error: Group \"" + group_name + "\" does not exist.\n";
-                        send(client_socket, err.c_str(), err.size(), 0);
-                        continue;
-                    }
-                    // Verify that the sender is a member of the group.
-                    if (groups[group_name].find(client_socket) == groups[group_name].end())
-                    {
-                        string err = "Error: Not a member of group \"" + group_name + "\".\n";
-                        send(client_socket, err.c_str(), err.size(), 0);
-                        continue;
-                    }
-                }
-                group_message(client_socket, group_name, group_msg);
-            }
-            // Command: /leave_group <group name>
-            else if (message.substr(0, 12) == "/leave_group")
+    // Receive every descriptor before using any, so that a failure leaves none behind.
+    vector<int> fds(ok ? total : 0, -1);
+    for (size_t i = 0; ok && i < total; i += HANDOVER_FDS)
+        ok = recv_fds(fd, fds.data() + i, min<size_t>(HANDOVER_FDS, total - i));
+    if (!ok || !send_all(fd, "K", 1))
+    {
+        for (int received : fds)
+        {
+            if (received >= 0)
+                close(received);
+        }
+        close(fd);
+        return false;
+    }
+    close(fd);
+
+    size_t next = 0;
+    handover.listen_fds.assign(fds.begin(), fds.begin() + shard_count);
+    next += shard_count;
+    if (has_cluster)
+        handover.cluster_listen_fd = fds[next++];
+    if (has_metrics)
+        handover.metrics_listen_fd = fds[next++];
+    for (auto &shard_fds : handover.fds)
+    {
+        for (int &client_fd : shard_fds)
+            client_fd = fds[next++];
+    }
+    return true;
+}
+
+int main(int argc, char *argv[])
+{
+    // Number of reactor threads; "--shards N" runs N of them, one per listening socket.
+    int num_shards = 1;
+    string users_file = "users.txt";
+    int metrics_port = 0; // 0 leaves the metrics endpoint off.
+    int auth_workers = 2;  // Threads that verify passwords.
+    double user_rate = 20, group_rate = 200; // Messages per second; 0 disables the limit.
+    uint64_t user_burst = 40, group_burst = 400;
+    string upgrade_path;  // Unix socket on which a new process may take over from this one.
+    string takeover_path; // Upgrade socket of the running process to take over from.
+    for (int i = 1; i < argc; i++)
+    {
+        string arg = argv[i];
+        if (arg == "--shards" && i + 1 < argc)
+            num_shards = atoi(argv[++i]);
+        else if (arg == "--users" && i + 1 < argc)
+            users_file = argv[++i];
+        else if (arg == "--max-queue" && i + 1 < argc)
+            max_queue_bytes = strtoull(argv[++i], nullptr, 10);
+        else if (arg == "--io-uring")
+            use_io_uring = true;
+        else if (arg == "--upgrade-socket" && i + 1 < argc)
+            upgrade_path = argv[++i];
+        else if (arg == "--takeover" && i + 1 < argc)
+            takeover_path = argv[++i];
+        else if (arg == "--port" && i + 1 < argc)
+            listen_port = atoi(argv[++i]);
+        else if (arg == "--node-id" && i + 1 < argc)
+            node_id = atoi(argv[++i]);
+        else if (arg == "--cluster-port" && i + 1 < argc)
+            cluster_port = atoi(argv[++i]);
+        else if (arg == "--peer" && i + 1 < argc)
+        {
+            if (!add_peer(argv[++i]))
             {
-                if (message.size() <= 12 || message[12] != ' ')
-                {
-                    string err = "Error: Incorrect format. Use: /leave_group <group name>\n";
-                    send(client_socket, err.c_str(), err.size(), 0);
-                    continue;
-                }
-                string group_name = message.substr(13);
-                if (group_name.empty())
-                {
-                    string err = "Error: Group name cannot be empty.\n";
-                    send(client_socket, err.c_str(), err.size(), 0);
-                    continue;
-                }
-                {
-                    lock_guard<mutex> lock(groups_mutex);
-                    if (groups.count(group_name))
-                    {
-                        if (groups[group_name].find(client_socket) != groups[group_name].end())
-                        {
-                            groups[group_name].erase(client_socket);
-                            string reply = "Left group \"" + group_name + "\" successfully.\n";
-                            send(client_socket, reply.c_str(), reply.size(), 0);
-                        }
-                        else
-                        {
-                            string reply = "Error: Not a member of group \"" + group_name + "\".\n";
-                            send(client_socket, reply.c_str(), reply.size(), 0);
-                        }
-                    }
-                    else
-                    {
-                        string reply = "Error: Group \"" + group_name + "\" does not exist.\n";
-                        send(client_socket, reply.c_str(), reply.size(), 0);
-                    }
-                }
+                cerr << "Error: Invalid peer \"" << argv[i] << "\"; use ID@HOST:PORT.\n";
+                return 1;
             }
-            // Unknown command.
+        }
+        else if (arg == "--user-rate" && i + 1 < argc)
+            user_rate = atof(argv[++i]);
+        else if (arg == "--user-burst" && i + 1 < argc)
+            user_burst = strtoull(argv[++i], nullptr, 10);
+        else if (arg == "--group-rate" && i + 1 < argc)
+            group_rate = atof(argv[++i]);
+        else if (arg == "--group-burst" && i + 1 < argc)
+            group_burst = strtoull(argv[++i], nullptr, 10);
+        else if (arg == "--auth-timeout" && i + 1 < argc)
+            auth_timeout_ms = strtoull(argv[++i], nullptr, 10) * 1000;
+        else if (arg == "--ping-interval" && i + 1 < argc)
+            ping_interval_ms = strtoull(argv[++i], nullptr, 10) * 1000;
+        else if (arg == "--idle-timeout" && i + 1 < argc)
+            idle_timeout_ms = strtoull(argv[++i], nullptr, 10) * 1000;
+        else if (arg == "--auth-workers" && i + 1 < argc)
+            auth_workers = atoi(argv[++i]);
+        else if (arg == "--hash-users" && i + 1 < argc)
+            return hash_users_file(argv[++i]) ? 0 : 1;
+        else if (arg == "--log-dir" && i + 1 < argc)
+            log_dir = argv[++i];
+        else if (arg == "--history" && i + 1 < argc)
+            history_length = strtoull(argv[++i], nullptr, 10);
+        else if (arg == "--metrics-port" && i + 1 < argc)
+            metrics_port = atoi(argv[++i]);
+        else if (arg == "--slow-policy" && i + 1 < argc)
+        {
+            string policy = argv[++i];
+            if (policy == "drop")
+                slow_policy = SlowPolicy::Drop;
+            else if (policy == "disconnect")
+                slow_policy = SlowPolicy::Disconnect;
+            else if (policy == "coalesce")
+                slow_policy = SlowPolicy::Coalesce;
             else
             {
-                string err = "Error: Unknown command.\n";
-                send(client_socket, err.c_str(), err.size(), 0);
+                cerr << "Error: Unknown slow consumer policy \"" << policy << "\".\n";
+                return 1;
             }
         }
-
-        // --- Client Disconnection ---
+        else
         {
-            lock_guard<mutex> lock(clients_mutex);
-            string leave_msg = username + " has left the chat.\n";
-            for (const auto &client : clients)
-            {
-                if (client.first != client_socket)
-                {
-                    send(client.first, leave_msg.c_str(), leave_msg.size(), 0);
-                }
-            }
-            clients.erase(client_socket);
+            cerr << "Usage: " << argv[0] << " [--shards N] [--users FILE] [--max-queue BYTES] [--slow-policy drop|disconnect|coalesce] [--metrics-port PORT] [--log-dir DIR] [--history N] [--io-uring] [--auth-workers N] [--auth-timeout SECONDS] [--ping-interval SECONDS] [--idle-timeout SECONDS] [--user-rate N] [--user-burst N] [--group-rate N] [--group-burst N] [--port PORT] [--node-id ID --cluster-port PORT [--peer ID@HOST:PORT]...] [--upgrade-socket PATH] [--takeover PATH] | --hash-users FILE\n";
+            return 1;
         }
-        cout << username << " disconnected." << endl;
     }
-    else
+    if (num_shards < 1)
     {
-        string auth_fail = "Error: Authentication failed.\n";
-        send(client_socket, auth_fail.c_str(), auth_fail.size(), 0);
+        cerr << "Error: Number of shards must be at least 1.\n";
+        return 1;
+    }
+    if (max_queue_bytes == 0)
+    {
+        cerr << "Error: Maximum queue size must be positive.\n";
+        return 1;
+    }
+    if (listen_port <= 0 || listen_port > 65535)
+    {
+        cerr << "Error: Invalid port.\n";
+        return 1;
+    }
+    if (node_id >= MAX_NODES || (node_id < 0) != (cluster_port == 0) || (node_id < 0 && !peer_links.empty()) ||
+        cluster_port < 0 || cluster_port > 65535 || cluster_port == listen_port)
+    {
+        cerr << "Error: A cluster node needs a --node-id below " << MAX_NODES << " and a --cluster-port.\n";
+        return 1;
+    }
+    for (auto &link : peer_links)
+    {
+        if (link->node == node_id)
+        {
+            cerr << "Error: A peer cannot have this node's id.\n";
+            return 1;
+        }
+    }
+    if (user_rate < 0 || group_rate < 0)
+    {
+        cerr << "Error: Rate limits cannot be negative.\n";
+        return 1;
+    }
+    user_limit.set(user_rate, max<uint64_t>(user_burst, BROADCAST_COST));
+    group_limit.set(group_rate, group_burst);
+    if (auth_timeout_ms == 0)
+    {
+        cerr << "Error: Login timeout must be positive.\n";
+        return 1;
+    }
+    if (auth_workers < 1)
+    {
+        cerr << "Error: Number of authentication workers must be at least 1.\n";
+        return 1;
     }
-    close(client_socket);
-}
-
-int main()
-{
-    // Load valid user credentials from file.
-    load_users("users.txt");
 
-    // Create a TCP socket.
-    int server_socket = socket(AF_INET, SOCK_STREAM, 0);
-    if (server_socket < 0)
+    if (metrics_port < 0 || metrics_port > 65535 || metrics_port == listen_port)
     {
-        cerr << "Error: Unable to create socket.\n";
+        cerr << "Error: Invalid metrics port.\n";
         return 1;
     }
 
-    // Set up the server address structure.
-    sockaddr_in server_addr{};
-    server_addr.sin_family = AF_INET;
-    server_addr.sin_port = htons(PORT);
-    server_addr.sin_addr.s_addr = INADDR_ANY;
+    // Take over from the running server process: its sockets, sessions and groups. It
+    // seals the message log first, so the log is recovered below. This comes before any
+    // thread starts, so that a failure can simply return. The old process refuses a
+    // takeover on other ports, so its listening sockets are the ones asked for.
+    Handover handover;
+    if (!takeover_path.empty())
+    {
+        if (!take_over(takeover_path, num_shards, metrics_port, handover))
+        {
+            cerr << "Error: Unable to take over from the server at \"" << takeover_path << "\".\n";
+            return 1;
+        }
+        next_session.store(max<uint64_t>(handover.next_session, 1));
+        cluster_listen_fd = handover.cluster_listen_fd;
+        metrics_listen_fd = handover.metrics_listen_fd;
+    }
 
-    // Bind the socket to the specified port.
-    if (::bind(server_socket, (sockaddr *)&server_addr, sizeof(server_addr)) < 0)
+    // Load valid user credentials from file, reload them whenever the file changes, and
+    // start the workers that check passwords against them.
+    load_users(users_file);
+    thread(watch_users_file, users_file).detach();
+    for (int i = 0; i < auth_workers; i++)
+        thread(run_auth_worker).detach();
+
+    // Recover the message log and start its writer.
+    if (!log_dir.empty())
     {
-        cerr << "Error: Unable to bind socket.\n";
-        close(server_socket);
-        return 1;
+        log_wake_fd = eventfd(0, EFD_CLOEXEC);
+        if (log_wake_fd < 0 || !recover_log())
+            return 1;
+        thread(run_log_writer).detach();
     }
 
-    // Listen for incoming connections.
-    if (listen(server_socket, 5) < 0)
+    // Allow as many open sockets as the hard limit permits.
+    rlimit fd_limit{};
+    if (getrlimit(RLIMIT_NOFILE, &fd_limit) == 0)
+    {
+        fd_limit.rlim_cur = fd_limit.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &fd_limit);
+    }
+
+    for (int i = 0; i < num_shards; i++)
+    {
+        auto s = make_unique<Shard>();
+        s->id = i;
+        if (!open_shard(*s, num_shards > 1, takeover_path.empty() ? -1 : handover.listen_fds[i]))
+            return 1;
+        if (!takeover_path.empty())
+        {
+            s->handover_state = std::move(handover.states[i]);
+            s->handover_fds = std::move(handover.fds[i]);
+        }
+        shards.push_back(std::move(s));
+    }
+    for (const string &name : handover.names)
+        intern_name(name);
+    for (auto &entry : handover.groups)
     {
-        cerr << "Error: Unable to listen on port " << PORT << ".\n";
-        close(server_socket);
+        bool created;
+        get_or_create_group(entry.first, created)->rate_full_at.store(entry.second, memory_order_relaxed);
+    }
+
+    if (metrics_port && !start_metrics_endpoint(metrics_port))
+        return 1;
+
+    // Join the cluster: listen for peers and start dialling them.
+    if (node_id >= 0 && !start_cluster())
+        return 1;
+
+    // Accept takeovers by the next server process.
+    if (!upgrade_path.empty() && !start_upgrade_socket(upgrade_path))
         return 1;
+
+    if (use_io_uring)
+    {
+        use_buffer_ring = io_uring_works(true);
+        if (!use_buffer_ring && !io_uring_works(false))
+        {
+            cerr << "io_uring is unavailable; falling back to epoll.\n";
+            use_io_uring = false;
+        }
     }
 
-    cout << "Server is now listening on port " << PORT << "...\n";
+    cout << "Server is now listening on port " << listen_port << " with " << num_shards << " shard(s) using "
+         << (use_io_uring ? "io_uring" : "epoll") << "...\n";
+    if (node_id >= 0)
+        cout << "Cluster node " << node_id << " is accepting peers on port " << cluster_port << " and linking to "
+             << peer_links.size() << " peer(s).\n";
 
     // --- Server Control Thread ---
-    // Allows the server administrator to type "exit" in the server terminal to shut down the server.
-    thread server_control([]()
+    // Allows the server administrator to type "exit" in the server terminal to shut down the server,
+    // "stats" to print the current metrics, or "reload" to reread the users file.
+    thread server_control([users_file]()
                           {
         string command;
         while(getline(cin, command)) {
@@ -473,25 +5340,19 @@ int main()
                 cout << "Server shutting down...\n";
                 exit(0);
             }
+            if(command == "stats")
+                cout << render_metrics() << flush;
+            if(command == "reload" && load_users(users_file))
+                cout << "Reloaded users from \"" << users_file << "\"." << endl;
         } });
     server_control.detach();
 
-    // Main loop to accept and handle client connections.
-    while (true)
-    {
-        sockaddr_in client_addr{};
-        socklen_t addr_len = sizeof(client_addr);
-        int client_socket = accept(server_socket, (sockaddr *)&client_addr, &addr_len);
-        if (client_socket < 0)
-        {
-            cerr << "Error: Failed to accept client connection.\n";
-            continue;
-        }
-        // Create a new thread to handle the connected client.
-        thread client_thread(handle_client, client_socket);
-        client_thread.detach();
-    }
-
-    close(server_socket);
+    // Shard 0 runs on the main thread, the others on their own threads.
+    vector<thread> reactors;
+    for (int i = 1; i < num_shards; i++)
+        reactors.emplace_back(run_shard, shards[i].get());
+    run_shard(shards[0].get());
+    for (auto &reactor : reactors)
+        reactor.join();
     return 0;
 }
@@ -1,9 +1,11 @@
 #include <iostream>
 #include <cstring>
 #include <cstdlib>
+#include <cstddef>
 #include <unistd.h>
 #include <arpa/inet.h>
 #include <sys/socket.h>
+#include <linux/filter.h>
 #include <netinet/ip.h>
 #include <netinet/tcp.h>
 #include <sys/select.h>
@@ -16,17 +18,20 @@ using namespace std;
 //
 // SERVER_IP:       IP address of the server (localhost)
 // SERVER_PORT:     Port on which the server listens (12345)
+// CLIENT_PORT:     Default source port of our packets (54321)
 // CLIENT_SYN_SEQ:  Sequence number for our SYN packet (200)
-// SERVER_SYN_SEQ:  Expected server sequence in the SYN-ACK (400)
-// CLIENT_ACK_SEQ:  Sequence number for our final ACK (600)
 // TIMEOUT_SECONDS: Overall hardcoded timeout (in seconds) for waiting for a valid SYN-ACK
+// HEADER_BUFFER_BYTES: Receive buffer, large enough for IP and TCP headers with options
+//
+// The server picks a random sequence number for its SYN-ACK, so the final ACK
+// acknowledges whatever sequence number the SYN-ACK carried.
 //---------------------------------------------------------------------------------
 #define SERVER_IP "127.0.0.1"
 #define SERVER_PORT 12345
+#define CLIENT_PORT 54321
 #define CLIENT_SYN_SEQ 200
-#define SERVER_SYN_SEQ 400
-#define CLIENT_ACK_SEQ 600
 #define TIMEOUT_SECONDS 5
+#define HEADER_BUFFER_BYTES 128
 
 //---------------------------------------------------------------------------------
 // compute_checksum: Calculates the checksum for the IP header.
@@ -137,10 +142,12 @@ void send_tcp_packet(int sock, const char *src_ip, const char *dst_ip,
 //
 // Returns:
 //   true if a packet is successfully received and parsed; false otherwise.
+//
+// Only the headers are read, so the buffer is sized for the largest IP and TCP
+// headers and is not cleared between calls; longer packets are truncated.
 bool receive_tcp_packet(int sock, struct tcphdr &tcp_header, struct sockaddr_in &source_addr)
 {
-    char buffer[65536];
-    memset(buffer, 0, sizeof(buffer));
+    static char buffer[HEADER_BUFFER_BYTES];
     socklen_t addr_len = sizeof(source_addr);
 
     int data_size = recvfrom(sock, buffer, sizeof(buffer), 0,
@@ -154,6 +161,10 @@ bool receive_tcp_packet(int sock, struct tcphdr &tcp_header, struct sockaddr_in
     // Extract the IP header to determine its length.
     struct iphdr *ip = (struct iphdr *)buffer;
     int ip_header_len = ip->ihl * 4; // Convert header length from 32-bit words to bytes
+    if (data_size < (int)sizeof(struct iphdr) || data_size < ip_header_len + (int)sizeof(struct tcphdr))
+    {
+        return false;
+    }
 
     // Extract the TCP header (immediately following the IP header).
     struct tcphdr *tcp = (struct tcphdr *)(buffer + ip_header_len);
@@ -161,23 +172,66 @@ bool receive_tcp_packet(int sock, struct tcphdr &tcp_header, struct sockaddr_in
     return true;
 }
 
+//---------------------------------------------------------------------------------
+// attach_filter: Attaches a classic BPF program to the raw socket so that the kernel
+// only queues TCP packets from the server port to our port with SYN and ACK set.
+// Everything else on the host is dropped before it reaches select() and recvfrom().
+// The SYN-ACK is still validated in main(), and if the filter cannot be attached
+// the client just sees every TCP packet, as before.
+//
+// Parameters:
+//   sock        - The raw socket file descriptor.
+//   server_port - Port the SYN-ACK must come from.
+//   client_port - Port the SYN-ACK must go to.
+//---------------------------------------------------------------------------------
+void attach_filter(int sock, int server_port, int client_port)
+{
+    struct sock_filter code[] = {
+        // IPv4 carrying TCP, and not a later fragment
+        BPF_STMT(BPF_LD | BPF_B | BPF_ABS, offsetof(struct iphdr, protocol)),
+        BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, IPPROTO_TCP, 0, 11),
+        BPF_STMT(BPF_LD | BPF_H | BPF_ABS, offsetof(struct iphdr, frag_off)),
+        BPF_JUMP(BPF_JMP | BPF_JSET | BPF_K, IP_OFFMASK, 9, 0),
+        // From the server port to our port (X holds the IP header length)
+        BPF_STMT(BPF_LDX | BPF_B | BPF_MSH, 0),
+        BPF_STMT(BPF_LD | BPF_H | BPF_IND, offsetof(struct tcphdr, source)),
+        BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, (uint32_t)server_port, 0, 6),
+        BPF_STMT(BPF_LD | BPF_H | BPF_IND, offsetof(struct tcphdr, dest)),
+        BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, (uint32_t)client_port, 0, 4),
+        // Both SYN and ACK set
+        BPF_STMT(BPF_LD | BPF_B | BPF_IND, 13),
+        BPF_STMT(BPF_ALU | BPF_AND | BPF_K, TH_SYN | TH_ACK),
+        BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, TH_SYN | TH_ACK, 0, 1),
+        BPF_STMT(BPF_RET | BPF_K, HEADER_BUFFER_BYTES), // Accept, cut to the headers
+        BPF_STMT(BPF_RET | BPF_K, 0),                   // Drop
+    };
+    struct sock_fprog program = {sizeof(code) / sizeof(code[0]), code};
+    if (setsockopt(sock, SOL_SOCKET, SO_ATTACH_FILTER, &program, sizeof(program)) < 0)
+    {
+        perror("Packet filter not attached; filtering in userspace");
+    }
+}
+
 //---------------------------------------------------------------------------------
 // main: Implements the client-side TCP handshake using raw sockets.
 //
 // Handshake process:
 //   1. Send a SYN packet with sequence number CLIENT_SYN_SEQ (200).
 //   2. Wait (using a loop with a hardcoded overall timeout) for a valid SYN-ACK packet.
-//      - A valid SYN-ACK must have both SYN and ACK flags set, and the acknowledgment number must equal CLIENT_SYN_SEQ + 1.
-//   3. If a valid SYN-ACK is received, send the final ACK packet with sequence number CLIENT_ACK_SEQ (600)
-//      and acknowledgment number SERVER_SYN_SEQ + 1 (401).
+//      - A valid SYN-ACK comes from the server port to our port, has both SYN and ACK flags
+//        set, and its acknowledgment number equals CLIENT_SYN_SEQ + 1.
+//   3. If a valid SYN-ACK is received, send the final ACK packet with sequence number
+//      CLIENT_SYN_SEQ + 1 and acknowledgment number (SYN-ACK sequence number) + 1.
 //   4. The handshake only completes if the correct sequence numbers are used; otherwise, it fails.
+//
+// The source port may be given as an argument, so several clients can run at once.
 //---------------------------------------------------------------------------------
-int main()
+int main(int argc, char *argv[])
 {
-    const char *client_ip = "127.0.0.1"; // Client's IP (localhost)
-    const char *server_ip = SERVER_IP;   // Server's IP (localhost)
-    int client_port = 54321;             // Arbitrary client port
-    int server_port = SERVER_PORT;       // Server listening port (12345)
+    const char *client_ip = "127.0.0.1";                       // Client's IP (localhost)
+    const char *server_ip = SERVER_IP;                         // Server's IP (localhost)
+    int client_port = argc > 1 ? atoi(argv[1]) : CLIENT_PORT;  // Source port
+    int server_port = SERVER_PORT;                             // Server listening port (12345)
 
     // Create a raw socket for TCP.
     int sock = socket(AF_INET, SOCK_RAW, IPPROTO_TCP);
@@ -195,6 +249,9 @@ int main()
         exit(EXIT_FAILURE);
     }
 
+    // Only let the server's SYN-ACK for our port through to userspace.
+    attach_filter(sock, server_port, client_port);
+
     // ----- STEP 1: Send SYN Packet -----
     send_tcp_packet(sock, client_ip, server_ip, client_port, server_port,
                     CLIENT_SYN_SEQ, 0, true, false);
@@ -244,8 +301,10 @@ int main()
              << " Seq=" << ntohl(recv_tcp.seq)
              << " Ack=" << ntohl(recv_tcp.ack_seq) << endl;
 
-        // Validate: Check if the packet has both SYN and ACK flags set and the correct acknowledgment number.
-        if (recv_tcp.syn && recv_tcp.ack && (ntohl(recv_tcp.ack_seq) == CLIENT_SYN_SEQ + 1))
+        // Validate: Check if the packet is for our connection, has both SYN and ACK flags set
+        // and the correct acknowledgment number.
+        if (ntohs(recv_tcp.source) == server_port && ntohs(recv_tcp.dest) == client_port &&
+            recv_tcp.syn && recv_tcp.ack && (ntohl(recv_tcp.ack_seq) == CLIENT_SYN_SEQ + 1))
         {
             valid_syn_ack = true;
             break;
@@ -265,7 +324,7 @@ int main()
 
     // ----- STEP 3: Send Final ACK Packet to Complete Handshake -----
     send_tcp_packet(sock, client_ip, server_ip, client_port, server_port,
-                    CLIENT_ACK_SEQ, SERVER_SYN_SEQ + 1, false, true);
+                    CLIENT_SYN_SEQ + 1, ntohl(recv_tcp.seq) + 1, false, true);
     cout << "[+] Handshake complete." << endl;
 
     close(sock);
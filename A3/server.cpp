@@ -1,13 +1,53 @@
 #include <iostream>
 #include <cstring>
 #include <cstdlib>
+#include <cstddef>
+#include <cstdint>
+#include <cerrno>
+#include <ctime>
+#include <algorithm>
+#include <deque>
+#include <random>
+#include <vector>
 #include <sys/socket.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+#include <linux/filter.h>
+#include <linux/if_ether.h>
+#include <linux/if_packet.h>
+#include <net/if.h>
 #include <netinet/ip.h>
 #include <netinet/tcp.h>
 #include <arpa/inet.h>
+#include <poll.h>
 #include <unistd.h>
 
 #define SERVER_PORT 12345  // Listening port
+#define FLOW_TABLE_SIZE (1 << 17)  // Flow table slots (a power of two)
+#define FLOW_LIMIT (FLOW_TABLE_SIZE / 4 * 3)  // Half-open flows kept before new SYNs are dropped
+#define HALF_OPEN_TIMEOUT_MS 10000  // A SYN-ACK that is not acknowledged in time is forgotten
+#define POLL_INTERVAL_MS 100  // Longest wait for a packet before expiring flows
+#define STATS_INTERVAL_MS 5000  // Quiet mode: how often the counters are printed
+#define SOCKET_BUFFER_BYTES (32 << 20)  // Receive buffer, to absorb bursts of SYNs
+#define COOKIE_THRESHOLD (FLOW_LIMIT / 2)  // Half-open flows beyond which SYNs get cookies
+#define COOKIE_PERIOD_S 8  // A cookie is accepted for one to two periods
+#define BATCH_SIZE 64  // Packets received or sent per syscall
+#define PACKET_BUFFER_BYTES 2048  // Receive buffer per packet; only the headers are read
+#define FILTER_SNAPLEN 128  // Bytes of a matching packet the kernel passes on: the longest IP and TCP headers
+#define RING_BLOCK_BYTES (1 << 20)  // "--ring": size of each block of the capture ring
+#define RING_BLOCKS 64  // "--ring": blocks in the capture ring
+#define RING_FRAME_BYTES 2048  // "--ring": nominal frame size the kernel asks for
+#define RING_BLOCK_TIMEOUT_MS 10  // "--ring": longest a partly filled block waits for userspace
+
+// Per-packet output; "-q" turns it off and prints counters instead, for runs with
+// many concurrent handshakes.
+bool verbose = true;
+
+uint64_t now_ms() {
+    timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
 
 void print_tcp_flags(struct tcphdr *tcp) {
     std::cout << "[+] TCP Flags: "
@@ -19,9 +59,284 @@ void print_tcp_flags(struct tcphdr *tcp) {
               << " SEQ: " << ntohl(tcp->seq) << std::endl;
 }
 
-void send_syn_ack(int sock, struct sockaddr_in *client_addr, struct tcphdr *tcp) {
-    char packet[sizeof(struct iphdr) + sizeof(struct tcphdr)];
-    memset(packet, 0, sizeof(packet));
+// --- Flow table ---
+// One entry per handshake in progress, keyed on the 4-tuple of the client's packets
+// (kept in network byte order). The table is a single array probed linearly, so a
+// lookup usually touches one cache line, and it never allocates after startup.
+// Completed and expired flows are removed by shifting the rest of their probe run
+// back, so the table does not fill up with tombstones under churn.
+
+struct FlowKey {
+    uint32_t client_addr;
+    uint32_t server_addr;
+    uint16_t client_port;
+    uint16_t server_port;
+
+    bool operator==(const FlowKey &other) const {
+        return client_addr == other.client_addr && server_addr == other.server_addr &&
+               client_port == other.client_port && server_port == other.server_port;
+    }
+};
+
+struct Flow {
+    FlowKey key;
+    bool used;
+    uint32_t client_isn;  // Sequence number of the client's SYN
+    uint32_t server_isn;  // Sequence number of our SYN-ACK
+    uint64_t created_ms;  // When the SYN arrived; the flow expires HALF_OPEN_TIMEOUT_MS later
+};
+
+std::vector<Flow> flows(FLOW_TABLE_SIZE);
+size_t flow_count = 0;
+uint64_t hash_seed;  // Random, so clients cannot choose 4-tuples that collide
+
+// Half-open flows in arrival order, for expiry. Entries of flows that completed or were
+// replaced meanwhile are recognized by their timestamp and skipped.
+struct Expiry {
+    FlowKey key;
+    uint64_t created_ms;
+};
+std::deque<Expiry> expiry_queue;
+
+std::mt19937 isn_generator{std::random_device{}()};
+
+// Counters, printed every STATS_INTERVAL_MS in quiet mode.
+uint64_t handshakes_completed = 0;
+uint64_t flows_expired = 0;
+uint64_t syns_dropped = 0;
+uint64_t acks_rejected = 0;
+uint64_t cookies_sent = 0;
+uint64_t cookies_accepted = 0;
+
+size_t flow_slot(const FlowKey &key) {
+    uint64_t x = ((uint64_t)key.client_addr << 32 | key.server_addr) ^ hash_seed;
+    x ^= ((uint64_t)key.client_port << 16 | key.server_port) * 0x9e3779b97f4a7c15ull;
+    x = (x ^ (x >> 31)) * 0xbf58476d1ce4e5b9ull;
+    return (x ^ (x >> 29)) & (FLOW_TABLE_SIZE - 1);
+}
+
+Flow *find_flow(const FlowKey &key) {
+    for (size_t i = flow_slot(key); flows[i].used; i = (i + 1) & (FLOW_TABLE_SIZE - 1)) {
+        if (flows[i].key == key)
+            return &flows[i];
+    }
+    return nullptr;
+}
+
+// Adds a flow for a key that has none. Returns nullptr once FLOW_LIMIT flows exist.
+Flow *insert_flow(const FlowKey &key) {
+    if (flow_count >= FLOW_LIMIT)
+        return nullptr;
+    size_t i = flow_slot(key);
+    while (flows[i].used)
+        i = (i + 1) & (FLOW_TABLE_SIZE - 1);
+    flows[i].key = key;
+    flows[i].used = true;
+    flow_count++;
+    return &flows[i];
+}
+
+void remove_flow(Flow *flow) {
+    size_t hole = flow - flows.data();
+    for (size_t i = (hole + 1) & (FLOW_TABLE_SIZE - 1); flows[i].used; i = (i + 1) & (FLOW_TABLE_SIZE - 1)) {
+        // An entry may fill the hole unless its home slot lies after the hole.
+        size_t home = flow_slot(flows[i].key);
+        if (((i - home) & (FLOW_TABLE_SIZE - 1)) >= ((i - hole) & (FLOW_TABLE_SIZE - 1))) {
+            flows[hole] = flows[i];
+            hole = i;
+        }
+    }
+    flows[hole].used = false;
+    flow_count--;
+}
+
+// Forgets the half-open flows whose SYN-ACK went unanswered for HALF_OPEN_TIMEOUT_MS.
+void expire_flows(uint64_t now) {
+    while (!expiry_queue.empty() && now - expiry_queue.front().created_ms >= HALF_OPEN_TIMEOUT_MS) {
+        Flow *flow = find_flow(expiry_queue.front().key);
+        if (flow && flow->created_ms == expiry_queue.front().created_ms) {
+            remove_flow(flow);
+            flows_expired++;
+        }
+        expiry_queue.pop_front();
+    }
+}
+
+// --- SYN cookies ---
+// Once more than 'cookie_threshold' flows are half-open, the server stops keeping state
+// for new SYNs and encodes what it needs into the ISN of its SYN-ACK instead:
+//   bits 31-27: a counter that advances every COOKIE_PERIOD_S seconds
+//   bits 26-24: the client's MSS, as an index into 'mss_table'
+//   bits 23-0:  a keyed hash of the 4-tuple, the client's ISN, the counter and the
+//               MSS index, so none of them can be altered
+// The final ACK acknowledges cookie + 1 and carries the client's ISN + 1, so the cookie
+// can be checked without any stored state: recompute the hash for the counter found in
+// the cookie, which must be the current or the previous one. Memory therefore stays
+// flat under a SYN flood. The key is random per process and the hash is SipHash-2-4.
+
+const uint16_t mss_table[8] = {216, 536, 1024, 1220, 1360, 1400, 1440, 1460};
+size_t cookie_threshold = COOKIE_THRESHOLD;  // "--cookie-threshold N"; 0 sends cookies for every SYN
+uint64_t cookie_key[2];
+uint64_t last_cookie_ms = 0;  // When a cookie was last sent; 0 if never
+bool cookie_mode = false;     // Whether new SYNs currently get cookies
+
+uint64_t rotl(uint64_t x, int b) {
+    return (x << b) | (x >> (64 - b));
+}
+
+// SipHash-2-4 of 'count' 64-bit words.
+uint64_t siphash(const uint64_t key[2], const uint64_t *words, size_t count) {
+    uint64_t v0 = key[0] ^ 0x736f6d6570736575ull, v1 = key[1] ^ 0x646f72616e646f6dull;
+    uint64_t v2 = key[0] ^ 0x6c7967656e657261ull, v3 = key[1] ^ 0x7465646279746573ull;
+    auto round = [&] {
+        v0 += v1; v1 = rotl(v1, 13); v1 ^= v0; v0 = rotl(v0, 32);
+        v2 += v3; v3 = rotl(v3, 16); v3 ^= v2;
+        v0 += v3; v3 = rotl(v3, 21); v3 ^= v0;
+        v2 += v1; v1 = rotl(v1, 17); v1 ^= v2; v2 = rotl(v2, 32);
+    };
+    for (size_t i = 0; i <= count; i++) {
+        // The last block holds the message length in bytes.
+        uint64_t m = i < count ? words[i] : (uint64_t)(count * 8) << 56;
+        v3 ^= m;
+        round();
+        round();
+        v0 ^= m;
+    }
+    v2 ^= 0xff;
+    for (int i = 0; i < 4; i++)
+        round();
+    return v0 ^ v1 ^ v2 ^ v3;
+}
+
+uint32_t cookie_counter(uint64_t now) {
+    return (now / 1000 / COOKIE_PERIOD_S) & 31;
+}
+
+uint32_t cookie_hash(const FlowKey &key, uint32_t client_isn, uint32_t counter, uint32_t mss_index) {
+    uint64_t words[3] = {(uint64_t)key.client_addr << 32 | key.server_addr,
+                         (uint64_t)key.client_port << 48 | (uint64_t)key.server_port << 32 | client_isn,
+                         (uint64_t)mss_index << 32 | counter};
+    return siphash(cookie_key, words, 3) & 0xffffff;
+}
+
+// The client's MSS from the options of its SYN, or 536 (the default) without one.
+uint16_t syn_mss(struct tcphdr *tcp, int tcp_len) {
+    const unsigned char *options = (const unsigned char *)tcp + sizeof(struct tcphdr);
+    int length = std::min(tcp->doff * 4, tcp_len) - (int)sizeof(struct tcphdr);
+    for (int i = 0; i < length;) {
+        if (options[i] == 0)  // End of options
+            break;
+        if (options[i] == 1) {  // No-op
+            i++;
+            continue;
+        }
+        if (i + 1 >= length || options[i + 1] < 2)
+            break;
+        if (options[i] == 2 && options[i + 1] == 4 && i + 3 < length)
+            return (options[i + 2] << 8) | options[i + 3];
+        i += options[i + 1];
+    }
+    return 536;
+}
+
+uint32_t make_cookie(const FlowKey &key, uint32_t client_isn, uint16_t mss, uint64_t now) {
+    uint32_t mss_index = 0;
+    while (mss_index < 7 && mss_table[mss_index + 1] <= mss)
+        mss_index++;
+    uint32_t counter = cookie_counter(now);
+    return counter << 27 | mss_index << 24 | cookie_hash(key, client_isn, counter, mss_index);
+}
+
+// Checks the cookie acknowledged by an ACK. Returns the MSS it encodes, or 0 if it is
+// not a valid cookie for this 4-tuple and client ISN.
+uint16_t check_cookie(const FlowKey &key, struct tcphdr *tcp, uint64_t now) {
+    uint32_t cookie = ntohl(tcp->ack_seq) - 1;
+    uint32_t client_isn = ntohl(tcp->seq) - 1;
+    uint32_t counter = cookie >> 27;
+    uint32_t mss_index = (cookie >> 24) & 7;
+    uint32_t age = (cookie_counter(now) - counter) & 31;
+    if (age > 1 || cookie_hash(key, client_isn, counter, mss_index) != (cookie & 0xffffff))
+        return 0;
+    return mss_table[mss_index];
+}
+
+// --- Batched I/O ---
+// Packets are received up to BATCH_SIZE at a time with recvmmsg() into buffers that are
+// set up once, and the SYN-ACKs answering a batch are queued and sent together with
+// sendmmsg(). Under load, the number of syscalls then grows with batches, not packets.
+
+struct PacketBatch {
+    char buffers[BATCH_SIZE][PACKET_BUFFER_BYTES];
+    struct sockaddr_in addrs[BATCH_SIZE];
+    struct iovec iovecs[BATCH_SIZE];
+    struct mmsghdr messages[BATCH_SIZE];
+    int count = 0;  // Packets queued for sending
+
+    PacketBatch() {
+        memset(messages, 0, sizeof(messages));
+        for (int i = 0; i < BATCH_SIZE; i++) {
+            iovecs[i].iov_base = buffers[i];
+            messages[i].msg_hdr.msg_name = &addrs[i];
+            messages[i].msg_hdr.msg_iov = &iovecs[i];
+            messages[i].msg_hdr.msg_iovlen = 1;
+        }
+    }
+};
+
+PacketBatch received;
+PacketBatch outgoing;
+
+// Waits up to the socket's receive timeout for a packet, then takes whatever else is
+// already queued. Returns the number of packets, or -1 with errno set.
+int receive_batch(int sock) {
+    for (int i = 0; i < BATCH_SIZE; i++) {
+        received.iovecs[i].iov_len = PACKET_BUFFER_BYTES;
+        received.messages[i].msg_hdr.msg_namelen = sizeof(received.addrs[i]);
+    }
+    return recvmmsg(sock, received.messages, BATCH_SIZE, MSG_WAITFORONE, nullptr);
+}
+
+// Sends the queued packets. A packet the kernel refuses is reported and skipped.
+void flush_packets(int sock) {
+    int sent = 0;
+    while (sent < outgoing.count) {
+        int n = sendmmsg(sock, outgoing.messages + sent, outgoing.count - sent, 0);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            perror("sendmmsg() failed");
+            n = 1;
+        } else if (verbose) {
+            for (int i = sent; i < sent + n; i++) {
+                struct tcphdr *tcp = (struct tcphdr *)(outgoing.buffers[i] + sizeof(struct iphdr));
+                std::cout << "[+] Sent SYN-ACK with sequence " << ntohl(tcp->seq) << std::endl;
+            }
+        }
+        sent += n;
+    }
+    outgoing.count = 0;
+}
+
+// Queues a packet of 'length' bytes for 'addr' and returns its zeroed buffer, flushing
+// the queue first if it is full.
+char *queue_packet(int sock, struct sockaddr_in *addr, size_t length) {
+    if (outgoing.count == BATCH_SIZE)
+        flush_packets(sock);
+    int i = outgoing.count++;
+    outgoing.addrs[i] = *addr;
+    outgoing.iovecs[i].iov_len = length;
+    outgoing.messages[i].msg_hdr.msg_namelen = sizeof(outgoing.addrs[i]);
+    memset(outgoing.buffers[i], 0, length);
+    return outgoing.buffers[i];
+}
+
+// --- Handshake ---
+
+// Answers a SYN with a SYN-ACK carrying the flow's ISN. The reply goes back from the
+// address the SYN was sent to, with the rest of the batch.
+void send_syn_ack(int sock, struct sockaddr_in *client_addr, const FlowKey &key, uint32_t seq, uint32_t ack_seq) {
+    const size_t length = sizeof(struct iphdr) + sizeof(struct tcphdr);
+    char *packet = queue_packet(sock, client_addr, length);
 
     struct iphdr *ip = (struct iphdr *)packet;
     struct tcphdr *tcp_response = (struct tcphdr *)(packet + sizeof(struct iphdr));
@@ -30,39 +345,191 @@ void send_syn_ack(int sock, struct sockaddr_in *client_addr, struct tcphdr *tcp)
     ip->ihl = 5;
     ip->version = 4;
     ip->tos = 0;
-    ip->tot_len = htons(sizeof(packet));
+    ip->tot_len = htons(length);
     ip->id = htons(54321);
     ip->frag_off = 0;
     ip->ttl = 64;
     ip->protocol = IPPROTO_TCP;
-    ip->saddr = client_addr->sin_addr.s_addr;
-    ip->daddr = inet_addr("127.0.0.1");  // Server address
+    ip->saddr = key.server_addr;
+    ip->daddr = key.client_addr;
 
     // Fill TCP header
-    tcp_response->source = tcp->dest;
-    tcp_response->dest = tcp->source;
-    tcp_response->seq = htonl(400);
-    tcp_response->ack_seq = htonl(ntohl(tcp->seq) + 1);
+    tcp_response->source = key.server_port;
+    tcp_response->dest = key.client_port;
+    tcp_response->seq = htonl(seq);
+    tcp_response->ack_seq = htonl(ack_seq);
     tcp_response->doff = 5;
     tcp_response->syn = 1;
     tcp_response->ack = 1;
     tcp_response->window = htons(8192);
     tcp_response->check = 0;  // Kernel will compute the checksum
+}
+
+// Starts a handshake, or answers a retransmitted SYN with the same ISNs as before. A
+// retransmission leaves the flow as it was, so resending SYNs does not keep it from
+// expiring. Past the cookie threshold, a SYN without a flow is answered with a cookie
+// instead.
+void handle_syn(int sock, struct sockaddr_in *source_addr, const FlowKey &key, struct tcphdr *tcp, int tcp_len, uint64_t now) {
+    Flow *flow = find_flow(key);
+    // Leave cookie mode only once a quarter of the threshold has drained, so that the
+    // mode does not flap while a flood holds the table near the threshold.
+    if (!flow && (cookie_mode ? flow_count < cookie_threshold - cookie_threshold / 4 : flow_count >= cookie_threshold)) {
+        cookie_mode = !cookie_mode;
+        std::cout << (cookie_mode ? "[+] Answering SYNs with cookies at " : "[+] Keeping state for SYNs again at ")
+                  << flow_count << " half-open flows" << std::endl;
+    }
+    if (!flow && cookie_mode) {
+        uint32_t client_isn = ntohl(tcp->seq);
+        cookies_sent++;
+        last_cookie_ms = now;
+        if (verbose)
+            std::cout << "[+] Received SYN from " << inet_ntoa(source_addr->sin_addr) << ":" << ntohs(key.client_port)
+                      << ", answering with a cookie" << std::endl;
+        send_syn_ack(sock, source_addr, key, make_cookie(key, client_isn, syn_mss(tcp, tcp_len), now), client_isn + 1);
+        return;
+    }
+    if (flow) {
+        if (verbose)
+            std::cout << "[+] Received a retransmitted SYN from " << inet_ntoa(source_addr->sin_addr) << ":"
+                      << ntohs(key.client_port) << std::endl;
+        send_syn_ack(sock, source_addr, key, flow->server_isn, flow->client_isn + 1);
+        return;
+    }
+    flow = insert_flow(key);
+    if (!flow) {
+        syns_dropped++;
+        if (verbose)
+            std::cout << "[-] Flow table full, dropping SYN from " << inet_ntoa(source_addr->sin_addr) << std::endl;
+        return;
+    }
+    flow->server_isn = isn_generator();
+    flow->client_isn = ntohl(tcp->seq);
+    flow->created_ms = now;
+    expiry_queue.push_back({key, now});
+    if (verbose)
+        std::cout << "[+] Received SYN from " << inet_ntoa(source_addr->sin_addr) << ":" << ntohs(key.client_port) << std::endl;
+    send_syn_ack(sock, source_addr, key, flow->server_isn, flow->client_isn + 1);
+}
+
+// Completes a handshake if the ACK acknowledges our SYN-ACK: it must belong to a
+// half-open flow, acknowledge the server ISN + 1, and follow the client's SYN. Without
+// a flow, it may acknowledge a cookie sent during the last two cookie periods.
+void handle_ack(const FlowKey &key, struct sockaddr_in *source_addr, struct tcphdr *tcp, uint64_t now) {
+    Flow *flow = find_flow(key);
+    if (!flow && last_cookie_ms && now - last_cookie_ms < 2000 * COOKIE_PERIOD_S) {
+        uint16_t mss = check_cookie(key, tcp, now);
+        if (mss) {
+            cookies_accepted++;
+            handshakes_completed++;
+            if (verbose)
+                std::cout << "[+] Received ACK with a valid cookie (MSS " << mss << "), handshake complete with "
+                          << inet_ntoa(source_addr->sin_addr) << ":" << ntohs(key.client_port) << std::endl;
+            return;
+        }
+    }
+    if (!flow || ntohl(tcp->ack_seq) != flow->server_isn + 1 || ntohl(tcp->seq) != flow->client_isn + 1) {
+        acks_rejected++;
+        if (verbose)
+            std::cout << "[-] Ignoring ACK that matches no handshake from " << inet_ntoa(source_addr->sin_addr) << std::endl;
+        return;
+    }
+    remove_flow(flow);
+    handshakes_completed++;
+    if (verbose)
+        std::cout << "[+] Received ACK, handshake complete with " << inet_ntoa(source_addr->sin_addr) << ":"
+                  << ntohs(key.client_port) << std::endl;
+}
 
-    // Send packet
-    if (sendto(sock, packet, sizeof(packet), 0, (struct sockaddr *)client_addr, sizeof(*client_addr)) < 0) {
-        perror("sendto() failed");
-    } else {
-        std::cout << "[+] Sent SYN-ACK" << std::endl;
+// Dispatches one received packet to the SYN or ACK handler.
+void handle_packet(int sock, char *buffer, int data_size, struct sockaddr_in *source_addr, uint64_t now) {
+    struct iphdr *ip = (struct iphdr *)buffer;
+    if (data_size < (int)sizeof(struct iphdr) || data_size < ip->ihl * 4 + (int)sizeof(struct tcphdr))
+        return;
+    if (ip->protocol != IPPROTO_TCP)  // The capture ring sees all IP traffic
+        return;
+    struct tcphdr *tcp = (struct tcphdr *)(buffer + (ip->ihl * 4));
+
+    // Only process packets for the correct destination port. The kernel filter already
+    // drops the rest, unless it could not be attached.
+    if (ntohs(tcp->dest) != SERVER_PORT) return;
+
+    if (verbose)
+        print_tcp_flags(tcp);
+
+    FlowKey key{ip->saddr, ip->daddr, tcp->source, tcp->dest};
+    if (tcp->syn == 1 && tcp->ack == 0) {
+        handle_syn(sock, source_addr, key, tcp, data_size - ip->ihl * 4, now);
+    }
+
+    if (tcp->ack == 1 && tcp->syn == 0 && tcp->rst == 0) {
+        handle_ack(key, source_addr, tcp, now);
     }
 }
 
+void print_stats() {
+    std::cout << "[+] Half-open: " << flow_count << " Completed: " << handshakes_completed
+              << " Expired: " << flows_expired << " SYNs dropped: " << syns_dropped
+              << " ACKs rejected: " << acks_rejected << " Cookies sent: " << cookies_sent
+              << " Cookies accepted: " << cookies_accepted << std::endl;
+}
+
+// --- Packet filter ---
+// A raw socket sees every TCP packet on the host, and the capture ring every IP packet
+// on its interface, but the server only wants SYNs and ACKs for SERVER_PORT. This
+// classic BPF program runs in the kernel on each packet, starting at the IP header, and
+// drops everything else before it is queued to us. Packets it passes are cut to their
+// headers. The checks in handle_packet() stay, in case the filter cannot be attached.
+void attach_filter(int sock) {
+    struct sock_filter code[] = {
+        // Not a packet we are sending ourselves (seen on the capture ring)
+        BPF_STMT(BPF_LD | BPF_W | BPF_ABS, (uint32_t)(SKF_AD_OFF + SKF_AD_PKTTYPE)),
+        BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, PACKET_OUTGOING, 15, 0),
+        // IPv4 carrying TCP, and not a later fragment
+        BPF_STMT(BPF_LD | BPF_B | BPF_ABS, 0),
+        BPF_STMT(BPF_ALU | BPF_RSH | BPF_K, 4),
+        BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, 4, 0, 12),
+        BPF_STMT(BPF_LD | BPF_B | BPF_ABS, offsetof(struct iphdr, protocol)),
+        BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, IPPROTO_TCP, 0, 10),
+        BPF_STMT(BPF_LD | BPF_H | BPF_ABS, offsetof(struct iphdr, frag_off)),
+        BPF_JUMP(BPF_JMP | BPF_JSET | BPF_K, IP_OFFMASK, 8, 0),
+        // To SERVER_PORT (X holds the IP header length)
+        BPF_STMT(BPF_LDX | BPF_B | BPF_MSH, 0),
+        BPF_STMT(BPF_LD | BPF_H | BPF_IND, offsetof(struct tcphdr, dest)),
+        BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, SERVER_PORT, 0, 5),
+        // An ACK without SYN or RST, or a SYN without ACK
+        BPF_STMT(BPF_LD | BPF_B | BPF_IND, 13),
+        BPF_STMT(BPF_ALU | BPF_AND | BPF_K, TH_SYN | TH_ACK | TH_RST),
+        BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, TH_ACK, 1, 0),
+        BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, TH_SYN, 0, 1),
+        BPF_STMT(BPF_RET | BPF_K, FILTER_SNAPLEN),  // Accept
+        BPF_STMT(BPF_RET | BPF_K, 0),               // Drop
+    };
+    struct sock_fprog program = {sizeof(code) / sizeof(code[0]), code};
+    if (setsockopt(sock, SOL_SOCKET, SO_ATTACH_FILTER, &program, sizeof(program)) < 0)
+        perror("Packet filter not attached; filtering in userspace");
+}
+
+uint64_t next_stats_ms = 0;
+
+// Expires flows and, in quiet mode, prints the counters when they are due.
+void housekeeping(uint64_t now) {
+    expire_flows(now);
+    if (!verbose && now >= next_stats_ms) {
+        print_stats();
+        next_stats_ms = now + STATS_INTERVAL_MS;
+    }
+}
+
+// Serves handshakes until the process is stopped. RSTs are not acted on: a client
+// using raw sockets has no kernel socket, so its kernel answers our SYN-ACK with a
+// RST before the client's own ACK arrives.
 void receive_syn() {
     int sock = socket(AF_INET, SOCK_RAW, IPPROTO_TCP);
     if (sock < 0) {
         perror("Socket creation failed");
         exit(EXIT_FAILURE);
     }
+    attach_filter(sock);
 
     // Enable IP header inclusion
     int one = 1;
@@ -71,42 +538,148 @@ void receive_syn() {
         exit(EXIT_FAILURE);
     }
 
-    char buffer[65536];
-    struct sockaddr_in source_addr;
-    socklen_t addr_len = sizeof(source_addr);
+    // The raw socket sees every TCP packet on the host, so give bursts room. Raising the
+    // buffer above net.core.rmem_max needs SO_RCVBUFFORCE (CAP_NET_ADMIN).
+    int buffer_bytes = SOCKET_BUFFER_BYTES;
+    if (setsockopt(sock, SOL_SOCKET, SO_RCVBUFFORCE, &buffer_bytes, sizeof(buffer_bytes)) < 0)
+        setsockopt(sock, SOL_SOCKET, SO_RCVBUF, &buffer_bytes, sizeof(buffer_bytes));
+
+    // Wake up periodically to expire flows even when no packets arrive.
+    timeval poll_interval{0, POLL_INTERVAL_MS * 1000};
+    setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &poll_interval, sizeof(poll_interval));
 
     while (true) {
-        int data_size = recvfrom(sock, buffer, sizeof(buffer), 0, (struct sockaddr *)&source_addr, &addr_len);
-        if (data_size < 0) {
-            perror("Packet reception failed");
+        int packets = receive_batch(sock);
+        uint64_t now = now_ms();
+        housekeeping(now);
+        if (packets < 0) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+                perror("Packet reception failed");
             continue;
         }
 
-        struct iphdr *ip = (struct iphdr *)buffer;
-        struct tcphdr *tcp = (struct tcphdr *)(buffer + (ip->ihl * 4));
+        for (int i = 0; i < packets; i++)
+            handle_packet(sock, received.buffers[i], received.messages[i].msg_len, &received.addrs[i], now);
+        flush_packets(sock);
+    }
 
-        // Only process packets for the correct destination port
-        if (ntohs(tcp->dest) != SERVER_PORT) continue;
+    close(sock);
+}
 
-        print_tcp_flags(tcp);
+// --- Capture ring ---
+// With "--ring IFACE", packets are read from a TPACKET_V3 ring shared with the kernel
+// instead of through a raw socket. The kernel fills blocks of the ring with every IP
+// packet on the interface and hands a block over when it is full or has waited
+// RING_BLOCK_TIMEOUT_MS; the server reads the headers in place, without a copy or a
+// syscall per packet, and gives the block back. SYN-ACKs still go out through a raw
+// socket, opened with IPPROTO_RAW so that it receives nothing itself. Returns false if
+// the ring cannot be set up, in which case the raw socket is used instead.
+bool receive_ring(const char *interface) {
+    unsigned int ifindex = if_nametoindex(interface);
+    if (ifindex == 0) {
+        perror("if_nametoindex() failed");
+        return false;
+    }
 
-        if (tcp->syn == 1 && tcp->ack == 0 && ntohl(tcp->seq) == 200) {
-            std::cout << "[+] Received SYN from " << inet_ntoa(source_addr.sin_addr) << std::endl;
-            send_syn_ack(sock, &source_addr, tcp);
+    // Bind to IP only once the ring exists, so no packets are queued before it.
+    int fd = socket(AF_PACKET, SOCK_DGRAM, 0);
+    if (fd < 0) {
+        perror("Packet socket creation failed");
+        return false;
+    }
+    attach_filter(fd);
+    int version = TPACKET_V3;
+    struct tpacket_req3 req;
+    memset(&req, 0, sizeof(req));
+    req.tp_block_size = RING_BLOCK_BYTES;
+    req.tp_block_nr = RING_BLOCKS;
+    req.tp_frame_size = RING_FRAME_BYTES;
+    req.tp_frame_nr = RING_BLOCK_BYTES / RING_FRAME_BYTES * RING_BLOCKS;
+    req.tp_retire_blk_tov = RING_BLOCK_TIMEOUT_MS;
+    if (setsockopt(fd, SOL_PACKET, PACKET_VERSION, &version, sizeof(version)) < 0 ||
+        setsockopt(fd, SOL_PACKET, PACKET_RX_RING, &req, sizeof(req)) < 0) {
+        perror("Capture ring setup failed");
+        close(fd);
+        return false;
+    }
+    size_t ring_bytes = (size_t)RING_BLOCK_BYTES * RING_BLOCKS;
+    char *ring = (char *)mmap(nullptr, ring_bytes, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (ring == MAP_FAILED) {
+        perror("mmap() failed");
+        close(fd);
+        return false;
+    }
+    struct sockaddr_ll link_addr;
+    memset(&link_addr, 0, sizeof(link_addr));
+    link_addr.sll_family = AF_PACKET;
+    link_addr.sll_protocol = htons(ETH_P_IP);
+    link_addr.sll_ifindex = ifindex;
+    if (bind(fd, (struct sockaddr *)&link_addr, sizeof(link_addr)) < 0) {
+        perror("Packet socket bind failed");
+        munmap(ring, ring_bytes);
+        close(fd);
+        return false;
+    }
+
+    int send_sock = socket(AF_INET, SOCK_RAW, IPPROTO_RAW);
+    if (send_sock < 0) {
+        perror("Socket creation failed");
+        munmap(ring, ring_bytes);
+        close(fd);
+        return false;
+    }
+    std::cout << "[+] Reading packets from a capture ring on " << interface << std::endl;
+
+    for (unsigned int block = 0;; block = (block + 1) % RING_BLOCKS) {
+        struct tpacket_block_desc *desc = (struct tpacket_block_desc *)(ring + (size_t)block * RING_BLOCK_BYTES);
+        while (!(__atomic_load_n(&desc->hdr.bh1.block_status, __ATOMIC_ACQUIRE) & TP_STATUS_USER)) {
+            struct pollfd pfd = {fd, POLLIN | POLLERR, 0};
+            poll(&pfd, 1, POLL_INTERVAL_MS);
+            housekeeping(now_ms());
         }
 
-        if (tcp->ack == 1 && tcp->syn == 0 && ntohl(tcp->seq) == 600) {
-            std::cout << "[+] Received ACK, handshake complete." << std::endl;
-            break;
+        uint64_t now = now_ms();
+        housekeeping(now);
+        char *frame = (char *)desc + desc->hdr.bh1.offset_to_first_pkt;
+        for (uint32_t i = 0; i < desc->hdr.bh1.num_pkts; i++) {
+            struct tpacket3_hdr *header = (struct tpacket3_hdr *)frame;
+            struct sockaddr_ll *link = (struct sockaddr_ll *)(frame + TPACKET_ALIGN(sizeof(struct tpacket3_hdr)));
+            // On loopback every packet is seen leaving as well as arriving.
+            if (link->sll_pkttype != PACKET_OUTGOING && header->tp_snaplen >= sizeof(struct iphdr)) {
+                struct sockaddr_in source_addr;
+                memset(&source_addr, 0, sizeof(source_addr));
+                source_addr.sin_family = AF_INET;
+                source_addr.sin_addr.s_addr = ((struct iphdr *)(frame + header->tp_net))->saddr;
+                handle_packet(send_sock, frame + header->tp_net, header->tp_snaplen, &source_addr, now);
+            }
+            frame += header->tp_next_offset;
         }
+        flush_packets(send_sock);
+        __atomic_store_n(&desc->hdr.bh1.block_status, TP_STATUS_KERNEL, __ATOMIC_RELEASE);
     }
-
-    close(sock);
 }
 
-int main() {
+int main(int argc, char *argv[]) {
+    const char *ring_interface = nullptr;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "-q") == 0) {
+            verbose = false;
+        } else if (strcmp(argv[i], "--cookie-threshold") == 0 && i + 1 < argc) {
+            cookie_threshold = strtoul(argv[++i], nullptr, 10);
+        } else if (strcmp(argv[i], "--ring") == 0 && i + 1 < argc) {
+            ring_interface = argv[++i];
+        } else {
+            std::cerr << "Usage: " << argv[0] << " [-q] [--cookie-threshold N] [--ring IFACE]" << std::endl;
+            return EXIT_FAILURE;
+        }
+    }
+    std::random_device entropy;
+    hash_seed = ((uint64_t)entropy() << 32) | entropy();
+    cookie_key[0] = ((uint64_t)entropy() << 32) | entropy();
+    cookie_key[1] = ((uint64_t)entropy() << 32) | entropy();
     std::cout << "[+] Server listening on port " << SERVER_PORT << "..." << std::endl;
+    if (ring_interface && !receive_ring(ring_interface))
+        std::cout << "[+] Falling back to a raw socket" << std::endl;
     receive_syn();
     return 0;
 }
-